@@ -28,11 +28,17 @@ static void bfdUsage(void)
 {
   fprintf(stderr, "Usage:\n");
   fprintf(stderr, "\tbfd -p <PeerAddress> [-d] [-m mult] [-r tout] [-t tout] \n"
-                  "\t     [-v] [-x <extension>[=<value>]]\n");
+                  "\t     [-E engine] [-i ifname] [-X ifname [-K]] [-v] [-x <extension>[=<value>]]\n");
   fprintf(stderr, "Where:\n");
   fprintf(stderr, "\t-p: create session with 'PeerAddress' (required option)\n");
   fprintf(stderr, "\t-d: toggle demand mode desired (default %s)\n",
           BFDDFLT_DEMANDMODE? "on" : "off");
+  fprintf(stderr, "\t-E engine: event engine, 'select' (default) or 'uring'\n");
+  fprintf(stderr, "\t-i ifname: use AF_PACKET rings for control packets on 'ifname'\n"
+                  "\t   (can be repeated)\n");
+  fprintf(stderr, "\t-X ifname: use AF_XDP sockets for control packets on 'ifname'\n"
+                  "\t   (can be repeated)\n");
+  fprintf(stderr, "\t-K: drop unchanged packets from Up peers in the XDP program\n");
   fprintf(stderr, "\t-m mult: detect multiplier (default %d)\n", BFDDFLT_DETECTMULT);
   fprintf(stderr, "\t-r tout: required min rx (default %d)\n", BFDDFLT_REQUIREDMINRX);
   fprintf(stderr, "\t-t tout: desired min tx (default %d)\n", BFDDFLT_DESIREDMINTX);
@@ -44,6 +50,7 @@ static void bfdUsage(void)
   fprintf(stderr, "Signals:\n");
   fprintf(stderr, "\tUSR1: start poll sequence on all demand mode sessions\n");
   fprintf(stderr, "\tUSR2: toggle admin down on all sessions\n");
+  fprintf(stderr, "\tHUP: log engine counters\n");
 }
 
 /*
@@ -58,6 +65,11 @@ int main(int argc, char **argv)
   struct in_addr localaddr = { .s_addr = INADDR_ANY };
   uint16_t PeerPort = BFDDFLT_UDPPORT;
   uint16_t LocalPort = BFDDFLT_UDPPORT;
+  tpEngineType engine = TP_ENGINE_SELECT;
+  char *pktIfs[BFD_PKTMAXIFS];
+  bool pktIfXdp[BFD_PKTMAXIFS];
+  int pktIfCount = 0;
+  int i;
 
   bfdSession bfd;
 
@@ -67,7 +79,7 @@ int main(int argc, char **argv)
   bfdLogInit();
 
   /* Get command line options */
-  while ((c = getopt(argc, argv, "dhm:p:r:t:vx:")) != -1) {
+  while ((c = getopt(argc, argv, "dE:hi:Km:p:r:t:vX:x:")) != -1) {
     switch (c) {
     case 'd':
       defDemandModeDesired = !defDemandModeDesired;
@@ -75,6 +87,19 @@ int main(int argc, char **argv)
     case 'h':
       bfdUsage();
       exit(0);
+    case 'i':
+    case 'X':
+      if (pktIfCount >= BFD_PKTMAXIFS) {
+        fprintf(stderr, "Too many packet engine interfaces\n\n");
+        bfdUsage();
+        exit(1);
+      }
+      pktIfXdp[pktIfCount] = (c == 'X');
+      pktIfs[pktIfCount++] = optarg;
+      break;
+    case 'K':
+      bfdXdpEnableFastPath();
+      break;
     case 'm':
       if (sscanf(optarg, "%" SCNu8, &defDetectMult) != 1) {
          fprintf(stderr, "Arg 'mult' must be an integer\n\n");
@@ -99,6 +124,17 @@ int main(int argc, char **argv)
          exit(1);
       }
       break;
+    case 'E':
+      if (strcmp(optarg, "select") == 0) {
+        engine = TP_ENGINE_SELECT;
+      } else if (strcmp(optarg, "uring") == 0) {
+        engine = TP_ENGINE_URING;
+      } else {
+        fprintf(stderr, "Unknown event engine: %s\n", optarg);
+        bfdUsage();
+        exit(1);
+      }
+      break;
     case 'v':
       bfdLogMore();
       break;
@@ -156,9 +192,23 @@ int main(int argc, char **argv)
   /* Init timers package */
   tpInitTimers();
 
+  if (engine != TP_ENGINE_SELECT && tpSetEngine(engine) < 0) {
+    bfdLog(LOG_WARNING, "Can't start requested event engine, using %s: %m\n",
+           tpGetEngineName());
+  }
+
+  /* Packet engines, before the session opens its sockets */
+  for (i = 0; i < pktIfCount; i++) {
+    if (!(pktIfXdp[i] ? bfdXdpAddInterface(pktIfs[i])
+                      : bfdPacketAddInterface(pktIfs[i]))) {
+      exit(1);
+    }
+  }
+
   /* Set signal handlers */
   tpSetSignalActor(bfdStartPollSequence, SIGUSR1);
   tpSetSignalActor(bfdToggleAdminDown, SIGUSR2);
+  tpSetSignalActor(bfdLogCounters, SIGHUP);
 
   /* Get peer address */
   if ((hp = gethostbyname(connectaddr)) == NULL) {
@@ -195,6 +245,8 @@ int main(int argc, char **argv)
     exit(1);
   }
 
+  bfdRtStartupDone();
+
   /* Wait for events */
   tpDoEventLoop();
 
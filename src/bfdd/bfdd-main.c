@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <string.h>
 #include <inttypes.h>
 #include "bfd.h"
 #include "bfd-monitor.h"
@@ -15,18 +16,33 @@
 static void bfddUsage(void)
 {
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, "\tbfdd [-c <config-file>] [-d] [-m port] [-v]\n");
+  fprintf(stderr, "\tbfdd [-c <config-file>] [-d] [-m port] [-v]\n"
+                  "\t     [-E engine] [-i ifname] [-X ifname [-K]] [-N] [-R prio] [-A cpu] [-P sessions]\n");
   fprintf(stderr, "Where:\n");
   fprintf(stderr, "\t-c: load 'config-file' for startup configuration\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "\t-d: Do not run in daemon mode\n");
+  fprintf(stderr, "\t-E engine: event engine, 'select' (default) or 'uring'\n");
+  fprintf(stderr, "\t-i ifname: use AF_PACKET rings for control packets on 'ifname'\n"
+                  "\t   (can be repeated)\n");
+  fprintf(stderr, "\t-X ifname: use AF_XDP sockets for control packets on 'ifname'\n"
+                  "\t   (can be repeated)\n");
+  fprintf(stderr, "\t-K: drop unchanged packets from Up peers in the XDP program\n");
+  fprintf(stderr, "\t-N: notify monitors after packet and timer processing instead of\n"
+                  "\t   from it\n");
   fprintf(stderr, "\t-m port: Port monitor server will listen on (default %d)\n",
           DEFAULT_MONITOR_PORT);
   fprintf(stderr, "\t-v: increase level of debug output (can be repeated)\n");
+  fprintf(stderr, "Real-time options:\n");
+  fprintf(stderr, "\t-R prio: run with SCHED_FIFO priority 'prio' and locked memory\n");
+  fprintf(stderr, "\t-A cpu: pin process to CPU 'cpu'\n");
+  fprintf(stderr, "\t-P sessions: preallocate objects for 'sessions' sessions\n"
+                  "\t   (default %d with -R)\n", BFDDFLT_RTSESSIONS);
   fprintf(stderr, "\n");
   fprintf(stderr, "Signals:\n");
   fprintf(stderr, "\tUSR1: start poll sequence on all demand mode sessions\n");
   fprintf(stderr, "\tUSR2: toggle admin down on all sessions\n");
+  fprintf(stderr, "\tHUP: log engine counters\n");
 }
 
 /*
@@ -38,11 +54,19 @@ int main(int argc, char **argv)
   char *configFile = NULL;
   int daemon_mode = 1;
   uint16_t monitor_port = DEFAULT_MONITOR_PORT;
+  bfdRtConfig rt = { .Priority = 0, .Cpu = -1 };
+  bool rtSessionsSet = false;
+  bool deferNotify = false;
+  tpEngineType engine = TP_ENGINE_SELECT;
+  char *pktIfs[BFD_PKTMAXIFS];
+  bool pktIfXdp[BFD_PKTMAXIFS];
+  int pktIfCount = 0;
+  int i;
 
   bfdLogInit();
 
   /* Get command line options */
-  while ((c = getopt(argc, argv, "c:dm:v")) != -1) {
+  while ((c = getopt(argc, argv, "A:c:dE:i:Km:NP:R:vX:")) != -1) {
     switch (c) {
     case 'c':
       configFile = optarg;
@@ -57,9 +81,59 @@ int main(int argc, char **argv)
         exit(1);
       }
       break;
+    case 'E':
+      if (strcmp(optarg, "select") == 0) {
+        engine = TP_ENGINE_SELECT;
+      } else if (strcmp(optarg, "uring") == 0) {
+        engine = TP_ENGINE_URING;
+      } else {
+        fprintf(stderr, "Unknown event engine: %s\n", optarg);
+        bfddUsage();
+        exit(1);
+      }
+      break;
+    case 'i':
+    case 'X':
+      if (pktIfCount >= BFD_PKTMAXIFS) {
+        fprintf(stderr, "Too many packet engine interfaces.\n");
+        bfddUsage();
+        exit(1);
+      }
+      pktIfXdp[pktIfCount] = (c == 'X');
+      pktIfs[pktIfCount++] = optarg;
+      break;
+    case 'K':
+      bfdXdpEnableFastPath();
+      break;
+    case 'N':
+      deferNotify = true;
+      break;
     case 'v':
       bfdLogMore();
       break;
+    case 'R':
+      if (sscanf(optarg, "%d", &rt.Priority) != 1 || rt.Priority <= 0) {
+        fprintf(stderr, "Expected positive integer for real-time priority.\n");
+        bfddUsage();
+        exit(1);
+      }
+      rt.LockMemory = true;
+      break;
+    case 'A':
+      if (sscanf(optarg, "%d", &rt.Cpu) != 1 || rt.Cpu < 0) {
+        fprintf(stderr, "Expected CPU number for affinity.\n");
+        bfddUsage();
+        exit(1);
+      }
+      break;
+    case 'P':
+      if (sscanf(optarg, "%" SCNu32, &rt.Sessions) != 1) {
+        fprintf(stderr, "Expected integer for preallocated sessions.\n");
+        bfddUsage();
+        exit(1);
+      }
+      rtSessionsSet = true;
+      break;
     default:
       bfddUsage();
       exit(1);
@@ -79,9 +153,37 @@ int main(int argc, char **argv)
   /* Init timers package */
   tpInitTimers();
 
+  if (engine != TP_ENGINE_SELECT && tpSetEngine(engine) < 0) {
+    bfdLog(LOG_WARNING, "Can't start requested event engine, using %s: %m\n",
+           tpGetEngineName());
+  }
+
+  if (deferNotify && !bfdSetNotifyMode(BFD_NOTIFY_DEFERRED)) {
+    exit(1);
+  }
+
+  /* Real-time settings and preallocation, before any session exists */
+  if (rt.LockMemory && !rtSessionsSet) {
+    rt.Sessions = BFDDFLT_RTSESSIONS;
+  }
+  if ((rt.LockMemory || rt.Cpu >= 0 || rt.Sessions) && !bfdRtSetup(&rt)) {
+    fprintf(stderr, "Error applying real-time settings\n");
+    exit(1);
+  }
+
+  /* Packet engines, before any session opens its sockets */
+  for (i = 0; i < pktIfCount; i++) {
+    if (!(pktIfXdp[i] ? bfdXdpAddInterface(pktIfs[i])
+                      : bfdPacketAddInterface(pktIfs[i]))) {
+      fprintf(stderr, "Error setting up packet engine on %s\n", pktIfs[i]);
+      exit(1);
+    }
+  }
+
   /* Set signal handlers */
   tpSetSignalActor(bfdStartPollSequence, SIGUSR1);
   tpSetSignalActor(bfdToggleAdminDown, SIGUSR2);
+  tpSetSignalActor(bfdLogCounters, SIGHUP);
 
   if (configFile && !bfdd_handleConfigFile(configFile)) {
     fprintf(stderr, "Error parsing config file\n");
@@ -90,6 +192,8 @@ int main(int argc, char **argv)
 
   bfdMonitorSetupServer(monitor_port);
 
+  bfdRtStartupDone();
+
   /* Wait for events */
   tpDoEventLoop();
 
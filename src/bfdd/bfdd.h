@@ -1,3 +1,6 @@
 #include <stdbool.h>
 
+/* Sessions preallocated in real-time mode unless -P is given */
+#define BFDDFLT_RTSESSIONS 1024
+
 bool bfdd_handleConfigFile(const char* cfgFile);
@@ -1,2 +1,3 @@
 SRCS := bfdmontest.c
 SRCS += tp-timers.c
+SRCS += tp-uring.c
@@ -12,6 +12,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <inttypes.h>
 #include "bfd.h"
 #include "bfdInt.h"
 #include "tp-timers.h"
@@ -23,6 +24,9 @@ static bfdSessionInt *sessionList;                  /* List of active sessions *
 static bfdSessionInt *sessionHash[BFD_HASHSIZE];    /* Find session from discriminator */
 static bfdSessionInt *peerHash[BFD_HASHSIZE];       /* Find session from peer address */
 
+bfdPool bfdSessionPool  = { .name = "session",  .itemSize = sizeof(bfdSessionInt) };
+bfdPool bfdNotifierPool = { .name = "notifier", .itemSize = sizeof(bfdNotifier) };
+
 static bfdSessionInt *bfdGetSession(uint8_t* cp, struct sockaddr_in *sin);
 static bfdSessionInt *bfdMatchSession(bfdSession *_bfd);
 static bfdSessionInt *bfdCreateSessionInt(bfdSession *_bfd);
@@ -33,22 +37,17 @@ static void bfdDetectTimeout(tpTimer *tim, void *arg);
 static void bfdNotify(bfdSessionInt *bfd);
 
 /*
- * All received packets come through here.
+ * All packets received on UDP sockets come through here.
  */
-void bfdRcvPkt(int s, void *arg)
+void bfdRcvPkt(int s, struct msghdr *msg, ssize_t mlen, void *arg)
 {
-  struct msghdr *msg = (struct msghdr *)arg;
-  ssize_t mlen;
-  struct sockaddr_in *sin;
-  uint8_t* cp;
   struct cmsghdr *cm;
-  bfdSessionInt *bfd;
-  uint32_t oldXmtTime;
-  bool goodTTL = false;
-  bool sendPkt = false;
+  bfdRxPkt pkt;
+
+  UNUSED(arg)
 
-  /* Get packet */
-  if ((mlen = recvmsg(s, msg, 0)) < 0) {
+  /* Check packet was received */
+  if (mlen < 0) {
     struct sockaddr_in tmp;
     socklen_t tmp_len = sizeof(struct sockaddr_in);
 
@@ -58,37 +57,54 @@ void bfdRcvPkt(int s, void *arg)
     return;
   }
 
-  /* Get source address */
-  sin = (struct sockaddr_in *)(msg->msg_name);
+  pkt.cp = (uint8_t*)(msg->msg_iov->iov_base);
+  pkt.len = mlen;
+  pkt.src = (struct sockaddr_in *)(msg->msg_name);
+  pkt.ttl = -1;
+  pkt.pktIf = NULL;
+  pkt.frame = NULL;
 
-  /* Get and check TTL */
+  /* Get TTL */
   for (cm = CMSG_FIRSTHDR(msg);
        cm != NULL;
        cm = CMSG_NXTHDR(msg, cm))
   {
     if (cm->cmsg_level == IPPROTO_IP &&
-        cm->cmsg_type == IP_TTL &&
-        *(uint32_t*)CMSG_DATA(cm) == BFD_1HOPTTLVALUE)
+        cm->cmsg_type == IP_TTL)
     {
-      goodTTL = true;
+      pkt.ttl = (int)*(uint32_t*)CMSG_DATA(cm);
       break;
     }
   }
 
-  if (!goodTTL) {
+  bfdProcessPkt(&pkt);
+}
+
+/*
+ * Validate a received control packet and run the state machine.  The packet
+ * is not copied, so this can work directly on packet ring memory.
+ */
+void bfdProcessPkt(bfdRxPkt *pkt)
+{
+  struct sockaddr_in *sin = pkt->src;
+  uint8_t* cp = pkt->cp;
+  bfdSessionInt *bfd;
+  uint32_t oldXmtTime;
+  bool sendPkt = false;
+
+  /* Check TTL */
+  if (pkt->ttl != BFD_1HOPTTLVALUE) {
     bfdLog(LOG_INFO, "Received pkt with invalid TTL from %s:%d\n",
            inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
     return;
   }
 
-  if (mlen < BFD_MINPKTLEN) {
+  if (pkt->len < BFD_MINPKTLEN) {
     bfdLog(LOG_INFO, "Received short packet from %s:%d\n", 
            inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
     return;
   }
 
-  cp = (uint8_t*)(msg->msg_iov->iov_base);
-
   /* Various checks from RFC 5880, section 6.8.6 */
 
   if (CPKT_GET_VERS(cp) != BFD_VERSION) {
@@ -99,7 +115,7 @@ void bfdRcvPkt(int s, void *arg)
   }
 
   if (CPKT_GET_LEN(cp) < (CPKT_GET_AUTH(cp) ? BFD_MINPKTLEN_AUTH : BFD_MINPKTLEN) ||
-      CPKT_GET_LEN(cp) > mlen)
+      CPKT_GET_LEN(cp) > pkt->len)
   {
     bfdLog(LOG_INFO, "Invalid length %d in control pkt from %s:%d[%x]\n",
            CPKT_GET_LEN(cp), inet_ntoa(sin->sin_addr), ntohs(sin->sin_port),
@@ -148,6 +164,11 @@ void bfdRcvPkt(int s, void *arg)
     return;
   }
 
+  /* Remember the link layer path back to the peer */
+  if (pkt->pktIf != NULL || bfd->PktIf != NULL) {
+    bfdPacketLearn(bfd, pkt);
+  }
+
   bfd->RemoteDiscr = CPKT_GET_MY_DISCR(cp);
   bfd->RemoteSessionState = CPKT_GET_STATE(cp);
   bfd->RemoteDemandMode = CPKT_GET_DEMAND(cp);
@@ -246,6 +267,13 @@ void bfdRcvPkt(int s, void *arg)
     /* Demand mode - stop detection timer */
     tpStopTimer(&(bfd->DetectTimer));
   }
+
+  /* Let the XDP fast path take care of further copies of this packet */
+  if (bfd->SessionState == BFDSTATE_UP && !bfd->DemandModeActive) {
+    bfdXdpSessionUpdate(bfd, pkt);
+  } else {
+    bfdXdpSessionRemove(bfd);
+  }
   return;
 }
 
@@ -254,7 +282,7 @@ static void bfdNotify(bfdSessionInt *bfd)
   bfdNotifier *notify = bfd->notify;
 
   while (notify) {
-    notify->cb(bfd->SessionState, notify->cbArg);
+    bfdNotifyPost(notify, bfd->SessionState);
     notify = notify->next;
   }
 }
@@ -265,9 +293,17 @@ static void bfdNotify(bfdSessionInt *bfd)
 static void bfdDetectTimeout(tpTimer *tim, void *arg)
 {
   bfdSessionInt *bfd = (bfdSessionInt *)arg;
+  uint32_t idle;
 
   UNUSED(tim)
 
+  /* Packets dropped by the XDP fast path still count as received */
+  if (bfd->FastPath && (idle = bfdXdpSessionIdle(bfd)) < bfd->DetectTime) {
+    tpStartUsTimer(&(bfd->DetectTimer), bfd->DetectTime - idle,
+                   bfdDetectTimeout, bfd);
+    return;
+  }
+
   bfdLog(LOG_NOTICE, "[%x] Detect timeout with peer %s, state [%d] %s\n",
          bfd->LocalDiscr, bfd->Sn.SnIdStr, bfd->SessionState,
          bfdStateToStr(bfd->SessionState));
@@ -307,6 +343,8 @@ static void bfdSessionDown(bfdSessionInt *bfd, uint8_t diag)
   bfd->PollSeqInProgress = 0;
   bfd->DemandModeActive = 0;
 
+  bfdXdpSessionRemove(bfd);
+
   bfdLog(LOG_NOTICE, "[%x] Session DOWN to %s\n", bfd->LocalDiscr,
          bfd->Sn.SnIdStr);
 
@@ -391,13 +429,17 @@ void bfdSendCPkt(bfdSessionInt *bfd, int fbit)
   CPKT_SET_MIN_TX_INT(cp, bfd->SendDesiredMinTx);
   CPKT_SET_MIN_RX_INT(cp, bfd->Sn.RequiredMinRxInterval);
   CPKT_SET_MIN_ECHO_RX_INT(cp, 0);
-  sin.sin_family = AF_INET;
-  sin.sin_addr = bfd->Sn.PeerAddr;
-  sin.sin_port = htons(bfd->Sn.PeerPort);
-  if (sendto(bfd->TxSock, &cp, BFD_MINPKTLEN, 0, (struct sockaddr *)&sin,
-             sizeof(struct sockaddr_in)) < 0) {
-    bfdLog(LOG_WARNING, "[%x] Error sending control pkt: %m\n",
-           bfd->LocalDiscr);
+
+  /* Use the AF_PACKET Tx ring if the path to the peer is known */
+  if (bfd->PktIf == NULL || !bfdPacketSend(bfd, cp, BFD_MINPKTLEN)) {
+    sin.sin_family = AF_INET;
+    sin.sin_addr = bfd->Sn.PeerAddr;
+    sin.sin_port = htons(bfd->Sn.PeerPort);
+    if (tpSendTo(bfd->TxSock, &cp, BFD_MINPKTLEN, (struct sockaddr *)&sin,
+                 sizeof(struct sockaddr_in)) < 0) {
+      bfdLog(LOG_WARNING, "[%x] Error sending control pkt: %m\n",
+             bfd->LocalDiscr);
+    }
   }
 
   /* Restart the timer for next time */
@@ -432,7 +474,7 @@ bfdSubHndl bfdSubscribe(bfdSession *_bfd, bfdSubCB cb, void *arg)
     return NULL;
   }
 
-  notify = calloc(1, sizeof(bfdNotifier));
+  notify = bfdPoolAlloc(&bfdNotifierPool);
   if (notify == NULL) {
     bfdLog(LOG_ERR, "Unable to allocate memory for notifier: %m\n");
     return NULL;
@@ -467,7 +509,7 @@ bfdSubHndl bfdSubscribe(bfdSession *_bfd, bfdSubCB cb, void *arg)
   /* convey the current state of the session so that the subscriber can
    * set itself up properly
    */
-  cb(bfd->SessionState, arg);
+  bfdNotifyPost(notify, bfd->SessionState);
 
   return (void*)notify;
 }
@@ -507,7 +549,8 @@ void bfdUnsubscribe(bfdSubHndl hndl)
 
   bfdLog(LOG_DEBUG, "[%x] bfdUnsubscribe: %s\n", bfd->LocalDiscr, bfd->Sn.SnIdStr);
 
-  free(notify);
+  bfdNotifyCancel(notify);
+  bfdPoolFree(&bfdNotifierPool, notify);
 
   /* if there are no more listeners for the session, delete it */
   bfd->RefCnt--;
@@ -525,7 +568,7 @@ static bfdSessionInt *bfdCreateSessionInt(bfdSession *_bfd)
   uint32_t selectedMin;
   bfdSessionInt *bfd;
 
-  bfd = calloc(1, sizeof(bfdSessionInt));
+  bfd = bfdPoolAlloc(&bfdSessionPool);
   if (bfd == NULL) {
     bfdLog(LOG_ERR, "Unable to allocate BFD session: %m\n");
     return NULL;
@@ -536,7 +579,7 @@ static bfdSessionInt *bfdCreateSessionInt(bfdSession *_bfd)
   bfd->LocalDiscr = (uint32_t)((uintptr_t)bfd & 0xffffffff);
 
   if (!bfdSocketSetup(bfd)) {
-    free(bfd);
+    bfdPoolFree(&bfdSessionPool, bfd);
     return NULL;
   }
 
@@ -646,8 +689,9 @@ void bfdRmSession(bfdSessionInt *bfd)
 
   tpStopTimer(&(bfd->XmtTimer));
   tpStopTimer(&(bfd->DetectTimer));
+  bfdXdpSessionRemove(bfd);
 
-  free(bfd);
+  bfdPoolFree(&bfdSessionPool, bfd);
 }
 
 /*
@@ -732,9 +776,32 @@ void bfdToggleAdminDown(int sig)
       bfd->ActiveDesiredMinTx = selectedMin;
       tpStopTimer(&(bfd->XmtTimer));
       tpStopTimer(&(bfd->DetectTimer));
+      bfdXdpSessionRemove(bfd);
       bfdLog(LOG_NOTICE, "[%x] Session to %s disabled\n",
              bfd->LocalDiscr, bfd->Sn.SnIdStr);
       bfdNotify(bfd);
     }
   }
 }
+
+/*
+ * Called on receipt of SIGHUP.  Log engine counters.
+ */
+void bfdLogCounters(int sig)
+{
+  tpStats stats;
+
+  UNUSED(sig)
+
+  bfdRtLogCounters();
+
+  tpGetStats(&stats);
+  bfdLog(LOG_NOTICE, "Engine %s: %" PRIu64 " syscalls, %" PRIu64 " pkts rcvd, "
+         "%" PRIu64 " pkts sent, %" PRIu64 " send errors\n", tpGetEngineName(),
+         stats.syscalls, stats.rxDgrams, stats.txDgrams, stats.txErrors);
+
+  bfdPacketLogCounters();
+  bfdXdpLogCounters();
+  bfdCmdLogCounters();
+  bfdNotifyLogCounters();
+}
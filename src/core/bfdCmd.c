@@ -0,0 +1,316 @@
+/* Thread-safe control interface.  The session and notifier lists belong to
+ * the thread running the event loop, so other threads do not touch them.
+ * Instead they post commands to a lock-free multi-producer, single-consumer
+ * queue and wake the event loop through an eventfd.  The event loop drains
+ * the queue, runs each command with the normal API and reports the result
+ * through a completion callback (run on the event loop thread) or, when no
+ * callback is given, to the posting thread which waits for it.
+ *
+ * Posting a command takes no lock: producers swap themselves onto the head
+ * of the queue with one atomic exchange (an intrusive queue in the style of
+ * D. Vyukov's MPSC node queue).  Nothing on the packet path looks at the
+ * queue.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include "bfd.h"
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+#define UNUSED(x) { if(x){} }
+
+typedef enum {
+  BFDCMD_CREATE,
+  BFDCMD_DELETE,
+  BFDCMD_SUBSCRIBE,
+  BFDCMD_UNSUBSCRIBE
+} bfdCmdType;
+
+typedef struct _bfdCmd {
+  _Atomic(struct _bfdCmd *) next;
+  bfdCmdType  type;
+  bfdSession  sn;
+  bfdSubCB    subCb;
+  void       *subArg;
+  bfdSubHndl  hndl;          /* argument for unsubscribe, result of subscribe */
+  bool        ok;
+
+  /* Completion, either a callback or a waiting thread */
+  bfdCmdCB    cb;
+  void       *cbArg;
+  sem_t       done;
+} bfdCmd;
+
+static bfdCmd cmdStub;
+static _Atomic(bfdCmd *) cmdHead = &cmdStub;   /* producers push here */
+static bfdCmd *cmdTail = &cmdStub;             /* consumer pops here */
+static atomic_bool cmdWakePending;
+static int cmdFd = -1;
+static pthread_t cmdThread;
+
+static uint64_t cmdRun;
+static uint64_t cmdWakeups;
+
+/*
+ * Link a command in at the head of the queue.  Safe from any thread.
+ */
+static void bfdCmdEnqueue(bfdCmd *cmd)
+{
+  bfdCmd *prev;
+
+  atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&cmdHead, cmd, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+/*
+ * Queue a command and wake the event loop.
+ */
+static void bfdCmdPush(bfdCmd *cmd)
+{
+  uint64_t one = 1;
+
+  bfdCmdEnqueue(cmd);
+
+  /* One wakeup covers everything posted until the event loop reads it */
+  if (!atomic_exchange_explicit(&cmdWakePending, true, memory_order_acq_rel)) {
+    if (write(cmdFd, &one, sizeof(one)) < 0) {
+      bfdLog(LOG_ERR, "Unable to wake event loop: %m\n");
+    }
+  }
+}
+
+/*
+ * Take the oldest command off the queue, NULL if it is empty or a producer
+ * is half way through a push (it will have signalled the eventfd, so the
+ * command is picked up on the next wakeup).  Event loop thread only.
+ */
+static bfdCmd *bfdCmdPop(void)
+{
+  bfdCmd *tail = cmdTail;
+  bfdCmd *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == &cmdStub) {
+    if (next == NULL) { return NULL; }
+    cmdTail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+
+  if (next != NULL) {
+    cmdTail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load_explicit(&cmdHead, memory_order_acquire)) {
+    return NULL;
+  }
+
+  /* Last command in the queue: put the stub back behind it */
+  bfdCmdEnqueue(&cmdStub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    cmdTail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+/*
+ * Run a command and report its result.
+ */
+static void bfdCmdExec(bfdCmd *cmd)
+{
+  switch (cmd->type) {
+  case BFDCMD_CREATE:
+    cmd->ok = bfdCreateSession(&cmd->sn);
+    break;
+  case BFDCMD_DELETE:
+    cmd->ok = bfdDeleteSession(&cmd->sn);
+    break;
+  case BFDCMD_SUBSCRIBE:
+    cmd->hndl = bfdSubscribe(&cmd->sn, cmd->subCb, cmd->subArg);
+    cmd->ok = (cmd->hndl != NULL);
+    break;
+  case BFDCMD_UNSUBSCRIBE:
+    bfdUnsubscribe(cmd->hndl);
+    cmd->ok = true;
+    break;
+  }
+
+  cmdRun++;
+
+  if (cmd->cb != NULL) {
+    cmd->cb(cmd->ok, cmd->hndl, cmd->cbArg);
+    free(cmd);
+  } else {
+    /* The poster owns the command, don't touch it after this */
+    sem_post(&cmd->done);
+  }
+}
+
+/*
+ * Event loop actor for the eventfd.
+ */
+static void bfdCmdDrain(int fd, void *arg)
+{
+  uint64_t count;
+  bfdCmd *cmd;
+
+  UNUSED(arg)
+
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    bfdLog(LOG_ERR, "Unable to read command eventfd: %m\n");
+  }
+  cmdWakeups++;
+
+  /* Clear before draining so that a command posted from here on wakes us */
+  atomic_store_explicit(&cmdWakePending, false, memory_order_release);
+
+  while ((cmd = bfdCmdPop()) != NULL) {
+    bfdCmdExec(cmd);
+  }
+}
+
+/*
+ * Hand a command to the event loop.  Called from the event loop thread
+ * itself, the command is run straight away.
+ */
+static bool bfdCmdPost(bfdCmd *cmd, bfdCmdCB cb, void *arg, bfdSubHndl *hndl)
+{
+  bfdCmd *qcmd;
+  bool ok;
+
+  if (cmdFd < 0) {
+    bfdLog(LOG_ERR, "Command queue not initialized\n");
+    return false;
+  }
+
+  if (pthread_equal(pthread_self(), cmdThread)) {
+    cmd->cb = NULL;
+    bfdCmdExec(cmd);
+    if (hndl != NULL) { *hndl = cmd->hndl; }
+    if (cb != NULL) { cb(cmd->ok, cmd->hndl, arg); }
+    return cmd->ok || cb != NULL;
+  }
+
+  if (cb != NULL) {
+    if ((qcmd = malloc(sizeof(*qcmd))) == NULL) {
+      bfdLog(LOG_ERR, "Unable to allocate command: %m\n");
+      return false;
+    }
+    memcpy(qcmd, cmd, sizeof(*qcmd));
+    qcmd->cb = cb;
+    qcmd->cbArg = arg;
+    bfdCmdPush(qcmd);
+    return true;
+  }
+
+  /* No callback, wait for the result */
+  cmd->cb = NULL;
+  sem_init(&cmd->done, 0, 0);
+  bfdCmdPush(cmd);
+  while (sem_wait(&cmd->done) < 0 && errno == EINTR) {}
+  sem_destroy(&cmd->done);
+  ok = cmd->ok;
+  if (hndl != NULL) { *hndl = cmd->hndl; }
+
+  return ok;
+}
+
+static void bfdCmdSetup(bfdCmd *cmd, bfdCmdType type, bfdSession *bfd)
+{
+  memset(cmd, 0, sizeof(*cmd));
+  cmd->type = type;
+  if (bfd != NULL) {
+    cmd->sn = *bfd;
+  }
+}
+
+/*
+ * Set up the command queue on the calling thread's event loop.  That thread
+ * must be the one running the loop.
+ */
+bool bfdCmdInit(void)
+{
+  if (cmdFd >= 0) { return true; }
+
+  if ((cmdFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    bfdLog(LOG_ERR, "Unable to create command eventfd: %m\n");
+    return false;
+  }
+
+  if (tpSetSktActor(cmdFd, bfdCmdDrain, NULL, NULL) < 0) {
+    bfdLog(LOG_ERR, "Unable to watch command eventfd\n");
+    close(cmdFd);
+    cmdFd = -1;
+    return false;
+  }
+
+  cmdThread = pthread_self();
+
+  return true;
+}
+
+/*
+ * The command API.  With a callback, returns whether the command was queued
+ * and the callback later gets the result on the event loop thread.  Without
+ * one, waits for the command to run and returns its result.
+ */
+bool bfdCmdCreateSession(bfdSession *bfd, bfdCmdCB cb, void *arg)
+{
+  bfdCmd cmd;
+
+  bfdCmdSetup(&cmd, BFDCMD_CREATE, bfd);
+  return bfdCmdPost(&cmd, cb, arg, NULL);
+}
+
+bool bfdCmdDeleteSession(bfdSession *bfd, bfdCmdCB cb, void *arg)
+{
+  bfdCmd cmd;
+
+  bfdCmdSetup(&cmd, BFDCMD_DELETE, bfd);
+  return bfdCmdPost(&cmd, cb, arg, NULL);
+}
+
+/*
+ * 'subCb' is called on the event loop thread, including the first call
+ * with the current session state.  Without a completion callback the new
+ * handle is returned in 'hndl'.
+ */
+bool bfdCmdSubscribe(bfdSession *bfd, bfdSubCB subCb, void *subArg,
+                     bfdSubHndl *hndl, bfdCmdCB cb, void *arg)
+{
+  bfdCmd cmd;
+
+  bfdCmdSetup(&cmd, BFDCMD_SUBSCRIBE, bfd);
+  cmd.subCb = subCb;
+  cmd.subArg = subArg;
+  return bfdCmdPost(&cmd, cb, arg, hndl);
+}
+
+bool bfdCmdUnsubscribe(bfdSubHndl hndl, bfdCmdCB cb, void *arg)
+{
+  bfdCmd cmd;
+
+  bfdCmdSetup(&cmd, BFDCMD_UNSUBSCRIBE, NULL);
+  cmd.hndl = hndl;
+  return bfdCmdPost(&cmd, cb, arg, NULL);
+}
+
+void bfdCmdLogCounters(void)
+{
+  if (cmdFd < 0) { return; }
+
+  bfdLog(LOG_NOTICE, "Command queue: %" PRIu64 " commands in %" PRIu64
+         " wakeups\n", cmdRun, cmdWakeups);
+}
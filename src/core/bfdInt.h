@@ -16,6 +16,26 @@
 #define BFD_MKHKEY(val)            ((val) % BFD_HASHSIZE)
 #define BFD_SRCPORTINIT            49142
 #define BFD_SRCPORTMAX             65536
+#define BFD_RTSOCKRECS             16         /* Rx socket records preallocated */
+#define BFD_RTSTACKPREFAULT        (64*1024)  /* Bytes of stack touched at startup */
+
+/* Packet engines (see bfdPktIf.c, bfdPacket.c, bfdXdp.c) */
+#define BFD_PKTMAXPORTS            16         /* Local ports matched by the engine filters */
+#define BFD_PKTIFNAMSIZ            16
+#define BFD_PKTRXBLOCKSIZE         (1 << 16)  /* Rx ring block size */
+#define BFD_PKTRXBLOCKS            16         /* Rx ring blocks */
+#define BFD_PKTRXBLOCKTOV          1          /* Rx block retire timeout (ms) */
+#define BFD_PKTRXFRAMESIZE         2048       /* Nominal Rx frame size (V3 packs frames) */
+#define BFD_PKTTXBLOCKSIZE         4096       /* Tx ring block size */
+#define BFD_PKTTXFRAMESIZE         256        /* Tx ring frame size */
+#define BFD_PKTTXFRAMES            256        /* Tx ring frames */
+#define BFD_PKTHDRLEN              42         /* Ethernet + IPv4 + UDP headers */
+#define BFD_XDPMAXQUEUES           4          /* Rx queues given an XDP socket */
+#define BFD_XDPFRAMESIZE           2048       /* UMEM frame size */
+#define BFD_XDPFRAMES              1024       /* UMEM frames per queue, half Rx, half Tx */
+#define BFD_XDPRINGSIZE            512        /* Descriptors per XDP ring */
+#define BFD_XDPMAXSESSIONS         4096       /* Sessions in the XDP fast path map */
+#define BFD_NOTIFYRINGSIZE         4096       /* Deferred notifications, power of 2 */
 
 /*
  * Macros to get/set fields of control packet. Format is from RFC5880, section 4.1.
@@ -96,8 +116,56 @@ typedef struct _bfdSession {
   tpTimer  XmtTimer;
   int      TxSock;
   int      RxSock;
+
+  /* Path back to the peer through a packet engine, learned on Rx */
+  struct _bfdPktIf *PktIf;
+  uint8_t  PktHdr[BFD_PKTHDRLEN];
+
+  /* Unchanged packets from the peer are dropped by the XDP program */
+  bool     FastPath;
 } bfdSessionInt;
 
+/*
+ * Interface bound to a packet engine.  Each engine embeds this at the start of
+ * its own interface structure.
+ */
+typedef struct _bfdPktIf {
+  const struct _bfdPktOps *ops;
+  char      name[BFD_PKTIFNAMSIZ];
+  int       ifindex;
+  bool      filterUdp;    /* keep the interface's packets off the UDP sockets */
+  bool      txPending;    /* Tx frames queued since the last flush */
+
+  uint64_t  rxFrames;
+  uint64_t  rxBatches;
+  uint64_t  rxBad;
+  uint64_t  rxDrops;      /* dropped by the kernel */
+  uint64_t  txFrames;
+  uint64_t  txKicks;
+  uint64_t  txRingFull;
+} bfdPktIf;
+
+typedef struct _bfdPktOps {
+  const char *name;
+  bool (*send)(bfdPktIf *ifp, const uint8_t *hdr, const uint8_t *cp, size_t len);
+  void (*flush)(bfdPktIf *ifp);
+  void (*setPorts)(bfdPktIf *ifp, const uint16_t *ports, int nports);
+  void (*getStats)(bfdPktIf *ifp);
+} bfdPktOps;
+
+/*
+ * A received control packet, independent of the socket it came in on.
+ * 'cp' may point straight into a packet ring.
+ */
+typedef struct {
+  uint8_t            *cp;
+  ssize_t             len;
+  struct sockaddr_in *src;
+  int                 ttl;       /* IP TTL, -1 if unknown */
+  bfdPktIf           *pktIf;     /* packet engine interface, NULL for UDP sockets */
+  uint8_t            *frame;     /* Ethernet frame, when pktIf is set */
+} bfdRxPkt;
+
 typedef struct _bfdNotifier {
   bfdSubCB             cb;
   void                *cbArg;
@@ -105,12 +173,52 @@ typedef struct _bfdNotifier {
   struct _bfdNotifier *next;
 } bfdNotifier;
 
+/*
+ * Fixed-size object pool (see bfdRt.c)
+ */
+typedef struct _bfdPool {
+  const char *name;
+  size_t      itemSize;
+  void       *freeList;
+  uint32_t    avail;
+  uint64_t    hotAllocs;   /* pool misses after startup */
+} bfdPool;
+
+extern bfdPool bfdSessionPool;
+extern bfdPool bfdNotifierPool;
+extern bfdPool bfdSockRecPool;
+
+void *bfdPoolAlloc(bfdPool *pool);
+void bfdPoolFree(bfdPool *pool, void *item);
+void bfdRtLogCounters(void);
+
 void bfdSendCPkt(bfdSessionInt *bfd, int fbit);
 void bfdStartXmtTimer(bfdSessionInt *bfd);
 void bfdRmSession(bfdSessionInt *bfd);
 int bfdRmFromList(bfdSessionInt **list, bfdSessionInt *bfd);
 bool bfdSocketSetup(bfdSessionInt *bfd);
 bool bfdSocketClose(bfdSessionInt *bfd);
-void bfdRcvPkt(int s, void *arg);
+int bfdSocketGetPorts(uint16_t *ports, int max);
+void bfdRcvPkt(int s, struct msghdr *msg, ssize_t mlen, void *arg);
+void bfdProcessPkt(bfdRxPkt *pkt);
+
+bool bfdPacketRegister(bfdPktIf *ifp);
+void bfdPacketRxFrame(bfdPktIf *ifp, uint8_t *frame, uint32_t len);
+void bfdPacketLearn(bfdSessionInt *bfd, bfdRxPkt *pkt);
+bool bfdPacketSend(bfdSessionInt *bfd, const uint8_t *cp, size_t len);
+void bfdPacketFilterSocket(int sock);
+void bfdPacketUpdateFilter(void);
+void bfdPacketLogCounters(void);
+
+void bfdXdpSessionUpdate(bfdSessionInt *bfd, bfdRxPkt *pkt);
+void bfdXdpSessionRemove(bfdSessionInt *bfd);
+uint32_t bfdXdpSessionIdle(bfdSessionInt *bfd);
+void bfdXdpLogCounters(void);
+
+void bfdCmdLogCounters(void);
+
+void bfdNotifyPost(bfdNotifier *notify, bfdState state);
+void bfdNotifyCancel(bfdNotifier *notify);
+void bfdNotifyLogCounters(void);
 
 #endif /* __BFDINT_H__ */
@@ -0,0 +1,260 @@
+/* Delivery of session state changes to subscribers.  By default the
+ * callbacks run inline, from the packet or timer handler that changed the
+ * state, so a slow subscriber holds up every other session.  In the
+ * deferred modes the state change is put on a single-producer,
+ * single-consumer ring instead and the callbacks run later:
+ *
+ *  BFD_NOTIFY_DEFERRED: by the event loop, after the packets and timers of
+ *                       the current iteration have been handled.
+ *  BFD_NOTIFY_THREAD:   by a separate callback thread.  The subscriber's
+ *                       callback must then be safe to run on that thread.
+ *
+ * The ring is FIFO, so a subscriber sees the changes of a session in the
+ * order they happened.  Each event records when it was queued and the time
+ * to delivery is counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include "bfd.h"
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+#define UNUSED(x) { if(x){} }
+
+#define BFD_NOTIFY_MASK  (BFD_NOTIFYRINGSIZE - 1)
+
+typedef struct {
+  bfdNotifier *notify;       /* NULL once the subscriber has gone */
+  bfdSubCB     cb;
+  void        *cbArg;
+  bfdState     state;
+  uint64_t     queuedAt;     /* CLOCK_MONOTONIC ns */
+} bfdNotifyEvent;
+
+static bfdNotifyMode notifyMode = BFD_NOTIFY_INLINE;
+static bfdNotifyEvent notifyRing[BFD_NOTIFYRINGSIZE];
+static atomic_uint notifyHead;     /* written by the event loop */
+static atomic_uint notifyTail;     /* written by whoever runs the callbacks */
+static bool notifyPosted;          /* events queued since the last flush */
+static int notifyFd = -1;          /* wakes the callback thread */
+static pthread_t notifyThread;
+
+/* Updated by the consumer only */
+static uint64_t notifyDelivered;
+static uint64_t notifyLatencySum;  /* ns */
+static uint64_t notifyLatencyMax;  /* ns */
+static uint64_t notifyRingFull;    /* times the event loop had to wait */
+
+static uint64_t bfdNotifyNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Run the callbacks of all queued events.
+ */
+static void bfdNotifyDrain(void)
+{
+  uint32_t tail = atomic_load_explicit(&notifyTail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&notifyHead, memory_order_acquire);
+  bfdNotifyEvent *ev;
+  uint64_t lat;
+
+  while (tail != head) {
+    ev = &notifyRing[tail & BFD_NOTIFY_MASK];
+
+    if (ev->notify != NULL) {
+      ev->cb(ev->state, ev->cbArg);
+
+      lat = bfdNotifyNow() - ev->queuedAt;
+      notifyDelivered++;
+      notifyLatencySum += lat;
+      if (lat > notifyLatencyMax) {
+        notifyLatencyMax = lat;
+      }
+    }
+
+    /* Release the slot only after the callback is done with it */
+    tail++;
+    atomic_store_explicit(&notifyTail, tail, memory_order_release);
+    if (tail == head) {
+      head = atomic_load_explicit(&notifyHead, memory_order_acquire);
+    }
+  }
+}
+
+/*
+ * Event loop flush actor.  Runs after the packets and timers of each
+ * iteration.
+ */
+static void bfdNotifyFlush(void *arg)
+{
+  uint64_t one = 1;
+
+  UNUSED(arg)
+
+  if (!notifyPosted) { return; }
+  notifyPosted = false;
+
+  if (notifyMode == BFD_NOTIFY_DEFERRED) {
+    bfdNotifyDrain();
+  } else if (write(notifyFd, &one, sizeof(one)) < 0) {
+    bfdLog(LOG_ERR, "Unable to wake callback thread: %m\n");
+  }
+}
+
+static void *bfdNotifyThreadMain(void *arg)
+{
+  uint64_t count;
+
+  UNUSED(arg)
+
+  for (;;) {
+    if (read(notifyFd, &count, sizeof(count)) < 0) {
+      if (errno == EINTR) { continue; }
+      bfdLog(LOG_ERR, "Callback thread can't read eventfd: %m\n");
+      return NULL;
+    }
+    bfdNotifyDrain();
+  }
+
+  return NULL;
+}
+
+/*
+ * Wait until the consumer has caught up with 'upTo'.
+ */
+static void bfdNotifyWaitFor(uint32_t upTo)
+{
+  uint64_t one = 1;
+
+  if (write(notifyFd, &one, sizeof(one)) < 0) {
+    bfdLog(LOG_ERR, "Unable to wake callback thread: %m\n");
+  }
+  while ((int32_t)(upTo - atomic_load_explicit(&notifyTail,
+                                               memory_order_acquire)) > 0) {
+    sched_yield();
+  }
+}
+
+/*
+ * Choose how callbacks are run.  Must be called from the event loop thread
+ * before any session is subscribed to.
+ */
+bool bfdSetNotifyMode(bfdNotifyMode mode)
+{
+  if (mode == notifyMode) { return true; }
+
+  if (notifyMode != BFD_NOTIFY_INLINE) {
+    bfdLog(LOG_ERR, "Notification mode can only be set once\n");
+    return false;
+  }
+
+  if (mode == BFD_NOTIFY_THREAD) {
+    if ((notifyFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+      bfdLog(LOG_ERR, "Unable to create callback eventfd: %m\n");
+      return false;
+    }
+    if ((errno = pthread_create(&notifyThread, NULL, bfdNotifyThreadMain,
+                                NULL)) != 0) {
+      bfdLog(LOG_ERR, "Unable to start callback thread: %m\n");
+      close(notifyFd);
+      notifyFd = -1;
+      return false;
+    }
+    pthread_setname_np(notifyThread, "bfd-notify");
+  }
+
+  if (tpSetFlushActor(bfdNotifyFlush, NULL) < 0) {
+    bfdLog(LOG_ERR, "Can't add notification flush to event engine: %m\n");
+    return false;
+  }
+
+  notifyMode = mode;
+  return true;
+}
+
+/*
+ * Report a state to one subscriber, now or through the ring.
+ */
+void bfdNotifyPost(bfdNotifier *notify, bfdState state)
+{
+  uint32_t head, tail;
+  bfdNotifyEvent *ev;
+
+  if (notifyMode == BFD_NOTIFY_INLINE) {
+    notify->cb(state, notify->cbArg);
+    return;
+  }
+
+  head = atomic_load_explicit(&notifyHead, memory_order_relaxed);
+  tail = atomic_load_explicit(&notifyTail, memory_order_acquire);
+  if (head - tail == BFD_NOTIFYRINGSIZE) {
+    /* Full: make room rather than lose a state change */
+    notifyRingFull++;
+    if (notifyMode == BFD_NOTIFY_DEFERRED) {
+      bfdNotifyDrain();
+    } else {
+      bfdNotifyWaitFor(tail + 1);
+    }
+  }
+
+  ev = &notifyRing[head & BFD_NOTIFY_MASK];
+  ev->notify = notify;
+  ev->cb = notify->cb;
+  ev->cbArg = notify->cbArg;
+  ev->state = state;
+  ev->queuedAt = bfdNotifyNow();
+  atomic_store_explicit(&notifyHead, head + 1, memory_order_release);
+
+  notifyPosted = true;
+}
+
+/*
+ * A subscriber is going away, make sure its callback doesn't run again.
+ * Queued events are dropped in deferred mode.  The callback thread may be
+ * running them, so wait for it to get past them.
+ */
+void bfdNotifyCancel(bfdNotifier *notify)
+{
+  uint32_t head, tail;
+
+  if (notifyMode == BFD_NOTIFY_INLINE) { return; }
+
+  head = atomic_load_explicit(&notifyHead, memory_order_relaxed);
+  if (notifyMode == BFD_NOTIFY_DEFERRED) {
+    for (tail = atomic_load_explicit(&notifyTail, memory_order_relaxed);
+         tail != head; tail++) {
+      if (notifyRing[tail & BFD_NOTIFY_MASK].notify == notify) {
+        notifyRing[tail & BFD_NOTIFY_MASK].notify = NULL;
+      }
+    }
+  } else {
+    bfdNotifyWaitFor(head);
+  }
+}
+
+void bfdNotifyLogCounters(void)
+{
+  if (notifyMode == BFD_NOTIFY_INLINE) { return; }
+
+  bfdLog(LOG_NOTICE, "Notifications: %" PRIu64 " delivered, avg %" PRIu64
+         " us, max %" PRIu64 " us after the state change, %" PRIu64
+         " waits for ring space\n", notifyDelivered,
+         notifyDelivered ? notifyLatencySum / notifyDelivered / 1000 : 0,
+         notifyLatencyMax / 1000, notifyRingFull);
+}
@@ -0,0 +1,346 @@
+/* AF_PACKET engine for control packets (see bfdPktIf.c).  On the interfaces
+ * it is bound to, BFD control packets are read from a memory-mapped TPACKET_V3
+ * block ring and written as complete Ethernet/IPv4/UDP frames to a
+ * memory-mapped Tx ring.
+ *
+ * A socket filter on each ring only lets through IPv4/UDP packets addressed to
+ * this host, with TTL 255, that are not fragmented and are sent to one of the
+ * local ports that has a BFD receive socket.  The packets still reach the
+ * stack, so the UDP receive sockets drop packets from these interfaces.
+ *
+ * Rx blocks are handed back to the kernel in one batch after all ready blocks
+ * have been processed.  Tx frames are sent with one send() per flush.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include "bfd.h"
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+#define UNUSED(x) { if(x){} }
+
+/* Where frame data starts in a Tx ring frame (TPACKET3_HDRLEN less the
+ * sockaddr_ll, which is only filled in on Rx) */
+#define BFD_PKTTXDATA  ((sizeof(struct tpacket3_hdr) + TPACKET_ALIGNMENT - 1) & \
+                        ~(size_t)(TPACKET_ALIGNMENT - 1))
+
+typedef struct {
+  bfdPktIf  pi;
+  int       sock;
+  uint8_t  *rxRing;
+  uint8_t  *txRing;
+  uint32_t  rxCur;        /* next Rx block to look at */
+  uint32_t  txCur;        /* next Tx frame to fill */
+} bfdTpIf;
+
+static bfdTpIf tpIfs[BFD_PKTMAXIFS];
+static int tpIfCount;
+
+static void bfdPacketRead(int s, void *arg);
+static bool bfdPacketSendFrame(bfdPktIf *pi, const uint8_t *hdr,
+                               const uint8_t *cp, size_t len);
+static void bfdPacketKick(bfdPktIf *pi);
+static void bfdPacketSetPorts(bfdPktIf *pi, const uint16_t *ports, int nports);
+static void bfdPacketGetStats(bfdPktIf *pi);
+static bool bfdPacketAttachFilter(bfdTpIf *ifp, const uint16_t *ports, int nports);
+
+static const bfdPktOps bfdPacketOps = {
+  .name     = "AF_PACKET",
+  .send     = bfdPacketSendFrame,
+  .flush    = bfdPacketKick,
+  .setPorts = bfdPacketSetPorts,
+  .getStats = bfdPacketGetStats
+};
+
+/*
+ * Bind the engine to an interface.  Must be called after the timers package
+ * has been initialized and before any sessions are created.
+ */
+bool bfdPacketAddInterface(const char *ifname)
+{
+  bfdTpIf *ifp;
+  struct tpacket_req3 rxReq, txReq;
+  struct sockaddr_ll sll;
+  int version = TPACKET_V3;
+  int loss = 1;
+  size_t rxLen, txLen;
+  void *map;
+
+  if (tpIfCount >= BFD_PKTMAXIFS) {
+    bfdLog(LOG_ERR, "Too many AF_PACKET interfaces (max %d)\n", BFD_PKTMAXIFS);
+    return false;
+  }
+
+  ifp = &tpIfs[tpIfCount];
+  memset(ifp, 0, sizeof(bfdTpIf));
+  ifp->pi.ops = &bfdPacketOps;
+  ifp->pi.filterUdp = true;
+  snprintf(ifp->pi.name, sizeof(ifp->pi.name), "%s", ifname);
+
+  if ((ifp->pi.ifindex = (int)if_nametoindex(ifname)) == 0) {
+    bfdLog(LOG_ERR, "Unknown interface %s: %m\n", ifname);
+    return false;
+  }
+
+  /* No protocol yet, so nothing is queued before the filter is attached */
+  if ((ifp->sock = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+    bfdLog(LOG_ERR, "Can't create packet socket for %s: %m\n", ifname);
+    return false;
+  }
+
+  memset(&rxReq, 0, sizeof(rxReq));
+  rxReq.tp_block_size     = BFD_PKTRXBLOCKSIZE;
+  rxReq.tp_block_nr       = BFD_PKTRXBLOCKS;
+  rxReq.tp_frame_size     = BFD_PKTRXFRAMESIZE;
+  rxReq.tp_frame_nr       = (BFD_PKTRXBLOCKSIZE / BFD_PKTRXFRAMESIZE) * BFD_PKTRXBLOCKS;
+  rxReq.tp_retire_blk_tov = BFD_PKTRXBLOCKTOV;
+
+  memset(&txReq, 0, sizeof(txReq));
+  txReq.tp_block_size = BFD_PKTTXBLOCKSIZE;
+  txReq.tp_block_nr   = (BFD_PKTTXFRAMES * BFD_PKTTXFRAMESIZE) / BFD_PKTTXBLOCKSIZE;
+  txReq.tp_frame_size = BFD_PKTTXFRAMESIZE;
+  txReq.tp_frame_nr   = BFD_PKTTXFRAMES;
+
+  rxLen = (size_t)rxReq.tp_block_size * rxReq.tp_block_nr;
+  txLen = (size_t)txReq.tp_block_size * txReq.tp_block_nr;
+
+  if (setsockopt(ifp->sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+      setsockopt(ifp->sock, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0 ||
+      setsockopt(ifp->sock, SOL_PACKET, PACKET_RX_RING, &rxReq, sizeof(rxReq)) < 0 ||
+      setsockopt(ifp->sock, SOL_PACKET, PACKET_TX_RING, &txReq, sizeof(txReq)) < 0)
+  {
+    bfdLog(LOG_ERR, "Can't set up TPACKET_V3 rings for %s: %m\n", ifname);
+    close(ifp->sock);
+    return false;
+  }
+
+  /* Rx ring comes first in the mapping, Tx ring right after it */
+  map = mmap(NULL, rxLen + txLen, PROT_READ | PROT_WRITE, MAP_SHARED, ifp->sock, 0);
+  if (map == MAP_FAILED) {
+    bfdLog(LOG_ERR, "Can't map packet rings for %s: %m\n", ifname);
+    close(ifp->sock);
+    return false;
+  }
+  ifp->rxRing = map;
+  ifp->txRing = ifp->rxRing + rxLen;
+
+  if (!bfdPacketAttachFilter(ifp, NULL, 0)) {
+    munmap(map, rxLen + txLen);
+    close(ifp->sock);
+    return false;
+  }
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family   = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_IP);
+  sll.sll_ifindex  = ifp->pi.ifindex;
+
+  if (bind(ifp->sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+    bfdLog(LOG_ERR, "Can't bind packet socket to %s: %m\n", ifname);
+    munmap(map, rxLen + txLen);
+    close(ifp->sock);
+    return false;
+  }
+
+  if (tpSetSktActor(ifp->sock, bfdPacketRead, ifp, NULL) < 0) {
+    bfdLog(LOG_ERR, "Can't add packet socket for %s to event engine: %m\n",
+           ifname);
+    munmap(map, rxLen + txLen);
+    close(ifp->sock);
+    return false;
+  }
+
+  if (!bfdPacketRegister(&ifp->pi)) {
+    tpRmSktActor(ifp->sock);
+    munmap(map, rxLen + txLen);
+    close(ifp->sock);
+    return false;
+  }
+
+  tpIfCount++;
+
+  bfdLog(LOG_NOTICE, "AF_PACKET engine on %s: %zu byte Rx ring, %d Tx frames\n",
+         ifname, rxLen, BFD_PKTTXFRAMES);
+
+  return true;
+}
+
+/*
+ * Build and attach the ring filter for an interface, matching the given
+ * destination ports.
+ */
+static bool bfdPacketAttachFilter(bfdTpIf *ifp, const uint16_t *ports, int nports)
+{
+  struct sock_filter code[12 + BFD_PKTMAXPORTS + 2];
+  struct sock_fprog prog;
+  int drop, n, i;
+
+  /* Too many ports to list: accept any, UDP sockets still own the ports */
+  drop = 12 + ((nports > BFD_PKTMAXPORTS) ? 1 : nports);
+  n = 0;
+
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE));
+  n++;
+  code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, (uint8_t)(drop - n - 1));
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12);
+  n++;
+  code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, (uint8_t)(drop - n - 1));
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 9);
+  n++;
+  code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, (uint8_t)(drop - n - 1));
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 8);
+  n++;
+  code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BFD_1HOPTTLVALUE, 0, (uint8_t)(drop - n - 1));
+  n++;
+  /* More fragments flag or fragment offset set */
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 6);
+  n++;
+  code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, (uint8_t)(drop - n - 1), 0);
+  n++;
+  /* X = IP header length, then load the UDP destination port */
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN);
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2);
+  n++;
+  if (nports > BFD_PKTMAXPORTS) {
+    code[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 1);
+    n++;
+  } else {
+    for (i = 0; i < nports; i++) {
+      code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ports[i],
+                                             (uint8_t)(drop - n), 0);
+      n++;
+    }
+  }
+  code[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+  n++;
+
+  prog.len = (unsigned short)n;
+  prog.filter = code;
+
+  if (setsockopt(ifp->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    bfdLog(LOG_ERR, "Can't attach packet filter for %s: %m\n", ifp->pi.name);
+    return false;
+  }
+
+  return true;
+}
+
+static void bfdPacketSetPorts(bfdPktIf *pi, const uint16_t *ports, int nports)
+{
+  bfdPacketAttachFilter((bfdTpIf *)pi, ports, nports);
+}
+
+static struct tpacket_block_desc *bfdPacketRxBlock(bfdTpIf *ifp, uint32_t idx)
+{
+  return (struct tpacket_block_desc *)(ifp->rxRing + ((size_t)idx * BFD_PKTRXBLOCKSIZE));
+}
+
+/*
+ * Socket actor for a packet socket: process every block the kernel has
+ * retired, then give them all back.
+ */
+static void bfdPacketRead(int s, void *arg)
+{
+  bfdTpIf *ifp = arg;
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *ph;
+  uint32_t first = ifp->rxCur;
+  uint32_t count = 0;
+  uint32_t i;
+
+  UNUSED(s)
+
+  while (count < BFD_PKTRXBLOCKS) {
+    bd = bfdPacketRxBlock(ifp, ifp->rxCur);
+    if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+      break;
+    }
+
+    ph = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+      bfdPacketRxFrame(&ifp->pi, (uint8_t *)ph + ph->tp_mac, ph->tp_snaplen);
+      ph = (struct tpacket3_hdr *)((uint8_t *)ph + ph->tp_next_offset);
+    }
+
+    ifp->rxCur = (ifp->rxCur + 1) % BFD_PKTRXBLOCKS;
+    count++;
+  }
+
+  for (i = 0; i < count; i++) {
+    bd = bfdPacketRxBlock(ifp, (first + i) % BFD_PKTRXBLOCKS);
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  }
+
+  ifp->pi.rxBatches += count;
+}
+
+/*
+ * Write a frame to the Tx ring.  Returns false if the ring is full.
+ */
+static bool bfdPacketSendFrame(bfdPktIf *pi, const uint8_t *hdr,
+                               const uint8_t *cp, size_t len)
+{
+  bfdTpIf *ifp = (bfdTpIf *)pi;
+  struct tpacket3_hdr *ph;
+  uint8_t *data;
+
+  ph = (struct tpacket3_hdr *)(ifp->txRing + ((size_t)ifp->txCur * BFD_PKTTXFRAMESIZE));
+  if (__atomic_load_n(&ph->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+    return false;
+  }
+
+  data = (uint8_t *)ph + BFD_PKTTXDATA;
+  memcpy(data, hdr, BFD_PKTHDRLEN);
+  memcpy(data + BFD_PKTHDRLEN, cp, len);
+  ph->tp_len = (uint32_t)(BFD_PKTHDRLEN + len);
+  ph->tp_next_offset = 0;
+  __atomic_store_n(&ph->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  ifp->txCur = (ifp->txCur + 1) % BFD_PKTTXFRAMES;
+
+  return true;
+}
+
+/*
+ * Have the kernel send the frames queued on the Tx ring.
+ */
+static void bfdPacketKick(bfdPktIf *pi)
+{
+  bfdTpIf *ifp = (bfdTpIf *)pi;
+
+  if (send(ifp->sock, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+    bfdLog(LOG_WARNING, "Error sending on AF_PACKET ring %s: %m\n", pi->name);
+  }
+}
+
+static void bfdPacketGetStats(bfdPktIf *pi)
+{
+  bfdTpIf *ifp = (bfdTpIf *)pi;
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+
+  /* Kernel counters are reset when read */
+  if (getsockopt(ifp->sock, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+    pi->rxDrops += st.tp_drops;
+  }
+}
@@ -0,0 +1,309 @@
+/* Common support for the packet engines, which move BFD control packets
+ * between the protocol and an interface without going through UDP sockets:
+ * AF_PACKET TPACKET_V3 rings (bfdPacket.c) and AF_XDP sockets (bfdXdp.c).
+ *
+ * Received frames are checked and handed to bfdProcessPkt() in place.  The
+ * Ethernet, IP and UDP headers for a session are built when a packet from
+ * the peer is received through an engine, by turning the received headers
+ * around.  Until then, and whenever the engine can't take a packet, packets
+ * are sent on the session's UDP socket.  Frames queued by an engine during an
+ * event loop iteration are pushed out just before the loop waits again.
+ *
+ * The UDP receive sockets stay open to own the ports.  Engines that don't
+ * take every packet off the interface's path to the stack have the UDP
+ * sockets drop packets from the interface, so that each packet is processed
+ * once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <linux/filter.h>
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+#define UNUSED(x) { if(x){} }
+
+static bfdPktIf *pktIfs[BFD_PKTMAXIFS];
+static int pktIfCount;
+
+static void bfdPacketFlush(void *arg);
+
+/*
+ * Add an engine interface.  Must be done before any sessions are created.
+ */
+bool bfdPacketRegister(bfdPktIf *ifp)
+{
+  if (pktIfCount >= BFD_PKTMAXIFS) {
+    bfdLog(LOG_ERR, "Too many packet engine interfaces (max %d)\n", BFD_PKTMAXIFS);
+    return false;
+  }
+
+  if (pktIfCount == 0 && tpSetFlushActor(bfdPacketFlush, NULL) < 0) {
+    bfdLog(LOG_ERR, "Can't add packet engine flush to event engine: %m\n");
+    return false;
+  }
+
+  pktIfs[pktIfCount++] = ifp;
+
+  return true;
+}
+
+/*
+ * Tell the engines which local ports have a UDP receive socket, after one
+ * was opened or closed.
+ */
+void bfdPacketUpdateFilter(void)
+{
+  uint16_t ports[BFD_PKTMAXPORTS];
+  int nports, i;
+
+  if (pktIfCount == 0) { return; }
+
+  nports = bfdSocketGetPorts(ports, BFD_PKTMAXPORTS);
+
+  for (i = 0; i < pktIfCount; i++) {
+    pktIfs[i]->ops->setPorts(pktIfs[i], ports, nports);
+  }
+}
+
+/*
+ * Keep a UDP receive socket from seeing packets that arrive on the
+ * interfaces whose engines leave them on the path to the stack.
+ */
+void bfdPacketFilterSocket(int sock)
+{
+  struct sock_filter code[1 + BFD_PKTMAXIFS + 2];
+  struct sock_fprog prog;
+  int count, drop, n, i;
+
+  for (count = 0, i = 0; i < pktIfCount; i++) {
+    if (pktIfs[i]->filterUdp) { count++; }
+  }
+  if (count == 0) { return; }
+
+  drop = 1 + count + 1;
+  n = 0;
+
+  code[n] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_IFINDEX));
+  n++;
+  for (i = 0; i < pktIfCount; i++) {
+    if (!pktIfs[i]->filterUdp) { continue; }
+    code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           (uint32_t)pktIfs[i]->ifindex,
+                                           (uint8_t)(drop - n - 1), 0);
+    n++;
+  }
+  code[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+  n++;
+  code[n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  n++;
+
+  prog.len = (unsigned short)n;
+  prog.filter = code;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+    bfdLog(LOG_WARNING, "Can't attach interface filter to socket %d: %m\n", sock);
+  }
+}
+
+/*
+ * Hand a received Ethernet frame to the protocol.  The engine has already
+ * checked the protocol, TTL, fragmentation and port.
+ */
+void bfdPacketRxFrame(bfdPktIf *ifp, uint8_t *frame, uint32_t len)
+{
+  uint8_t *ip = frame + ETH_HLEN;
+  uint8_t *udp;
+  uint32_t ihl, ulen;
+  struct sockaddr_in sin;
+  bfdRxPkt pkt;
+
+  ifp->rxFrames++;
+
+  ihl = (uint32_t)(ip[0] & 0x0f) * 4;
+  if ((ip[0] >> 4) != 4 || ihl < 20 || len < ETH_HLEN + ihl + 8) {
+    ifp->rxBad++;
+    return;
+  }
+
+  udp = ip + ihl;
+  ulen = (uint32_t)(udp[4] << 8 | udp[5]);
+  if (ulen < 8 || ulen > len - ETH_HLEN - ihl) {
+    ifp->rxBad++;
+    return;
+  }
+
+  sin.sin_family = AF_INET;
+  memcpy(&sin.sin_addr, ip + 12, sizeof(sin.sin_addr));
+  memcpy(&sin.sin_port, udp, sizeof(sin.sin_port));
+
+  pkt.cp = udp + 8;
+  pkt.len = ulen - 8;
+  pkt.src = &sin;
+  pkt.ttl = ip[8];
+  pkt.pktIf = ifp;
+  pkt.frame = frame;
+
+  bfdProcessPkt(&pkt);
+}
+
+static uint16_t bfdPacketIpCsum(const uint8_t *ip)
+{
+  uint32_t sum = 0;
+  int i;
+
+  for (i = 0; i < 20; i += 2) {
+    sum += (uint32_t)(ip[i] << 8 | ip[i + 1]);
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return (uint16_t)~sum;
+}
+
+/*
+ * Learn the path back to the peer from a received packet.  Packets received
+ * on a UDP socket make the session go back to sending on its UDP socket.
+ */
+void bfdPacketLearn(bfdSessionInt *bfd, bfdRxPkt *pkt)
+{
+  uint8_t *hdr = bfd->PktHdr;
+  uint8_t *ip, *udp;
+  struct sockaddr_in sin;
+  socklen_t sinLen = sizeof(sin);
+  uint16_t csum;
+
+  if (pkt->pktIf == NULL) {
+    if (bfd->PktIf != NULL) {
+      bfdLog(LOG_INFO, "[%x] Packets from %s now arrive on UDP socket\n",
+             bfd->LocalDiscr, bfd->Sn.SnIdStr);
+    }
+    bfd->PktIf = NULL;
+    return;
+  }
+
+  ip = pkt->frame + ETH_HLEN;
+
+  /* Nothing to do if the addresses have not changed */
+  if (bfd->PktIf == pkt->pktIf &&
+      memcmp(hdr, pkt->frame + ETH_ALEN, ETH_ALEN) == 0 &&
+      memcmp(hdr + ETH_ALEN, pkt->frame, ETH_ALEN) == 0 &&
+      memcmp(hdr + ETH_HLEN + 12, ip + 16, 4) == 0)
+  {
+    return;
+  }
+
+  if (getsockname(bfd->TxSock, (struct sockaddr *)&sin, &sinLen) < 0) {
+    bfdLog(LOG_WARNING, "[%x] Can't get source port for %s: %m\n",
+           bfd->LocalDiscr, bfd->Sn.SnIdStr);
+    bfd->PktIf = NULL;
+    return;
+  }
+
+  /* Ethernet header, back to the sender */
+  memcpy(hdr, pkt->frame + ETH_ALEN, ETH_ALEN);
+  memcpy(hdr + ETH_ALEN, pkt->frame, ETH_ALEN);
+  hdr[12] = ETH_P_IP >> 8;
+  hdr[13] = ETH_P_IP & 0xff;
+
+  /* IPv4 header, fixed length, no ID, don't fragment */
+  ip = hdr + ETH_HLEN;
+  memset(ip, 0, 20);
+  ip[0] = 0x45;
+  ip[2] = 0;
+  ip[3] = 20 + 8 + BFD_MINPKTLEN;
+  ip[6] = 0x40;
+  ip[8] = BFD_1HOPTTLVALUE;
+  ip[9] = IPPROTO_UDP;
+  memcpy(ip + 12, pkt->frame + ETH_HLEN + 16, 4);
+  memcpy(ip + 16, &bfd->Sn.PeerAddr, 4);
+  csum = bfdPacketIpCsum(ip);
+  ip[10] = (uint8_t)(csum >> 8);
+  ip[11] = (uint8_t)(csum & 0xff);
+
+  /* UDP header, no checksum */
+  udp = ip + 20;
+  memcpy(udp, &sin.sin_port, 2);
+  udp[2] = (uint8_t)(bfd->Sn.PeerPort >> 8);
+  udp[3] = (uint8_t)(bfd->Sn.PeerPort & 0xff);
+  udp[4] = 0;
+  udp[5] = 8 + BFD_MINPKTLEN;
+  udp[6] = 0;
+  udp[7] = 0;
+
+  bfd->PktIf = pkt->pktIf;
+
+  bfdLog(LOG_INFO, "[%x] Sending to %s with %s on %s\n", bfd->LocalDiscr,
+         bfd->Sn.SnIdStr, bfd->PktIf->ops->name, bfd->PktIf->name);
+}
+
+/*
+ * Queue a control packet with the engine of the session's interface.  Returns
+ * false if the packet has to be sent some other way.
+ */
+bool bfdPacketSend(bfdSessionInt *bfd, const uint8_t *cp, size_t len)
+{
+  bfdPktIf *ifp = bfd->PktIf;
+
+  if (len != BFD_MINPKTLEN) {
+    return false;
+  }
+
+  if (!ifp->ops->send(ifp, bfd->PktHdr, cp, len)) {
+    ifp->txRingFull++;
+    return false;
+  }
+
+  ifp->txPending = true;
+  ifp->txFrames++;
+
+  return true;
+}
+
+/*
+ * Flush actor: have the engines send the frames queued since the last time.
+ */
+static void bfdPacketFlush(void *arg)
+{
+  bfdPktIf *ifp;
+  int i;
+
+  UNUSED(arg)
+
+  for (i = 0; i < pktIfCount; i++) {
+    ifp = pktIfs[i];
+    if (!ifp->txPending) { continue; }
+
+    ifp->txPending = false;
+    ifp->txKicks++;
+    ifp->ops->flush(ifp);
+  }
+}
+
+void bfdPacketLogCounters(void)
+{
+  bfdPktIf *ifp;
+  int i;
+
+  for (i = 0; i < pktIfCount; i++) {
+    ifp = pktIfs[i];
+
+    if (ifp->ops->getStats != NULL) {
+      ifp->ops->getStats(ifp);
+    }
+
+    bfdLog(LOG_NOTICE, "%s %s: %" PRIu64 " frames rcvd in %" PRIu64
+           " batches, %" PRIu64 " bad, %" PRIu64 " dropped, %" PRIu64
+           " frames sent in %" PRIu64 " flushes, %" PRIu64 " Tx ring full\n",
+           ifp->ops->name, ifp->name, ifp->rxFrames, ifp->rxBatches, ifp->rxBad,
+           ifp->rxDrops, ifp->txFrames, ifp->txKicks, ifp->txRingFull);
+  }
+}
@@ -0,0 +1,183 @@
+/* Real-time execution support.  A BFD process running short detection
+ * intervals can be pushed into a false session failure by the scheduler
+ * (preemption) or by the pager (page faults in the event loop).  This module
+ * moves the process to the SCHED_FIFO class, pins it to a CPU, locks its
+ * memory and preallocates the objects the protocol engine needs so that
+ * steady state operation does not allocate memory.
+ *
+ * Allocations that miss a pool after bfdRtStartupDone() has been called are
+ * counted and can be logged with bfdLogCounters().
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "bfd.h"
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+static bool rtStartupDone;
+static uint64_t rtTimerAllocs;
+
+/*
+ * Grow a pool by 'count' items, touching every page so that the memory is
+ * faulted in (and locked, if mlockall() is in effect) now.
+ */
+static bool bfdPoolReserve(bfdPool *pool, uint32_t count)
+{
+  uint8_t *chunk;
+  uint32_t i;
+
+  if (count == 0) { return true; }
+
+  if ((chunk = malloc(count * pool->itemSize)) == NULL) {
+    bfdLog(LOG_ERR, "Unable to preallocate %u %s objects: %m\n",
+           count, pool->name);
+    return false;
+  }
+  memset(chunk, 0, count * pool->itemSize);
+
+  for (i = 0; i < count; i++) {
+    bfdPoolFree(pool, chunk + (i * pool->itemSize));
+  }
+
+  return true;
+}
+
+/*
+ * Get a zeroed item from a pool, falling back to the heap if the pool is
+ * empty.
+ */
+void *bfdPoolAlloc(bfdPool *pool)
+{
+  void *item;
+
+  if ((item = pool->freeList) != NULL) {
+    pool->freeList = *(void **)item;
+    pool->avail--;
+    memset(item, 0, pool->itemSize);
+    return item;
+  }
+
+  if (rtStartupDone) {
+    pool->hotAllocs++;
+  }
+
+  return calloc(1, pool->itemSize);
+}
+
+/*
+ * Return an item to a pool.  Items that were allocated from the heap are
+ * kept in the pool as well.
+ */
+void bfdPoolFree(bfdPool *pool, void *item)
+{
+  *(void **)item = pool->freeList;
+  pool->freeList = item;
+  pool->avail++;
+}
+
+/*
+ * Touch the stack that the event loop will run on.
+ */
+static void bfdRtPrefaultStack(void)
+{
+  volatile uint8_t stack[BFD_RTSTACKPREFAULT];
+  uint32_t i;
+
+  for (i = 0; i < sizeof(stack); i += 1024) {
+    stack[i] = 0;
+  }
+}
+
+/*
+ * Apply real-time settings to the process and preallocate object pools.
+ * Must be called after the timers package has been initialized and before
+ * any sessions are created.
+ */
+bool bfdRtSetup(bfdRtConfig *cfg)
+{
+  if (cfg->LockMemory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      bfdLog(LOG_ERR, "Unable to lock process memory: %m\n");
+      return false;
+    }
+    bfdRtPrefaultStack();
+  }
+
+  if (!bfdPoolReserve(&bfdSessionPool, cfg->Sessions) ||
+      !bfdPoolReserve(&bfdNotifierPool, cfg->Sessions) ||
+      !bfdPoolReserve(&bfdSockRecPool, cfg->Sessions ? BFD_RTSOCKRECS : 0)) {
+    return false;
+  }
+
+  if (tpReserveTimers((2 * cfg->Sessions) + TP_MINTIMERS) < 0) {
+    bfdLog(LOG_ERR, "Unable to preallocate timers for %u sessions: %m\n",
+           cfg->Sessions);
+    return false;
+  }
+
+  if (cfg->Cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET((size_t)cfg->Cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+      bfdLog(LOG_ERR, "Unable to pin process to CPU %d: %m\n", cfg->Cpu);
+      return false;
+    }
+  }
+
+  if (cfg->Priority > 0) {
+    struct sched_param sp;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = cfg->Priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0) {
+      bfdLog(LOG_ERR, "Unable to set SCHED_FIFO priority %d: %m\n",
+             cfg->Priority);
+      return false;
+    }
+  }
+
+  bfdLog(LOG_NOTICE, "Real-time mode: priority %d, cpu %d, memory %s, "
+         "%u sessions preallocated\n", cfg->Priority, cfg->Cpu,
+         cfg->LockMemory ? "locked" : "unlocked", cfg->Sessions);
+
+  return true;
+}
+
+/*
+ * Mark the end of startup.  From now on, every allocation that misses a
+ * pool is counted as a hot path allocation.
+ */
+void bfdRtStartupDone(void)
+{
+  tpStats stats;
+
+  tpGetStats(&stats);
+  rtStartupDone = true;
+  rtTimerAllocs = stats.timerAllocs;
+}
+
+static void bfdPoolLogCounters(bfdPool *pool)
+{
+  bfdLog(LOG_NOTICE, "Pool %s: %u free, %" PRIu64 " allocations after startup\n",
+         pool->name, pool->avail, pool->hotAllocs);
+}
+
+void bfdRtLogCounters(void)
+{
+  tpStats stats;
+
+  tpGetStats(&stats);
+  bfdPoolLogCounters(&bfdSessionPool);
+  bfdPoolLogCounters(&bfdNotifierPool);
+  bfdPoolLogCounters(&bfdSockRecPool);
+  bfdLog(LOG_NOTICE, "Timer heap: %" PRIu64 " allocations after startup\n",
+         rtStartupDone ? stats.timerAllocs - rtTimerAllocs : 0);
+}
@@ -17,23 +17,7 @@ typedef struct _bfdSockRec {
 /* Only the receive sockets are potentially shared */
 static bfdSockRec *sRxSocks = NULL;
 
-/* Buffer and msghdr for received packets */
-static uint8_t msgbuf[BFD_MINPKTLEN];
-static struct iovec msgiov = {
-  &(msgbuf[0]),
-  sizeof(msgbuf)
-};
-static uint8_t cmsgbuf[sizeof(struct cmsghdr) + 4];
-static struct sockaddr_in msgaddr;
-static struct msghdr msghdr = {
-  (void *)&msgaddr,
-  sizeof(msgaddr),
-  &msgiov,
-  1,
-  (void *)&cmsgbuf,
-  sizeof(cmsgbuf),
-  0
-};
+bfdPool bfdSockRecPool = { .name = "sockrec", .itemSize = sizeof(bfdSockRec) };
 
 static bfdSockRec* findSock(bfdSessionInt *bfd)
 {
@@ -61,7 +45,7 @@ static bool setupRxSocket(bfdSessionInt *bfd)
   bfdSockRec *sockRec;
 
   if ((sockRec = findSock(bfd)) == NULL) {
-    sockRec = calloc(1, sizeof(bfdSockRec));
+    sockRec = bfdPoolAlloc(&bfdSockRecPool);
     if (sockRec == NULL) {
       bfdLog(LOG_ERR, "Unable to allocate socket record: %m\n");
       return false;
@@ -71,7 +55,7 @@ static bool setupRxSocket(bfdSessionInt *bfd)
       bfdLog(LOG_WARNING, "[%x] Can't create Rx socket [*:%d]: %m\n",
              bfd->LocalDiscr, bfd->Sn.LocalPort);
 
-      free(sockRec);
+      bfdPoolFree(&bfdSockRecPool, sockRec);
       return false;
     }
 
@@ -81,7 +65,7 @@ static bool setupRxSocket(bfdSessionInt *bfd)
              bfd->LocalDiscr, bfd->Sn.LocalPort);
 
       close(sock);
-      free(sockRec);
+      bfdPoolFree(&bfdSockRecPool, sockRec);
       return false;
     }
 
@@ -94,21 +78,26 @@ static bool setupRxSocket(bfdSessionInt *bfd)
              "[%x] Can't bind Rx socket to port %d: %m\n",
              bfd->LocalDiscr, bfd->Sn.LocalPort);
 
-      free(sockRec);
+      bfdPoolFree(&bfdSockRecPool, sockRec);
       close(sock);
       return false;
     }
 
+    /* Leave packets on AF_PACKET engine interfaces to the packet rings */
+    bfdPacketFilterSocket(sock);
+
     sockRec->sock = sock;
     sockRec->port = bfd->Sn.LocalPort;
     sockRec->refCnt = 1;
     sockRec->next = sRxSocks;
     sRxSocks = sockRec;
 
+    bfdPacketUpdateFilter();
+
     bfd->RxSock = sock;
 
-    /* Add socket to select poll */
-    tpSetSktActor(sock, bfdRcvPkt, (void *)&msghdr, NULL);
+    /* Add socket to the event engine */
+    tpSetDgramActor(sock, bfdRcvPkt, NULL);
 
     bfdLog(LOG_DEBUG, "[%x] Created new Rx socket %d [*:%d]\n",
            bfd->LocalDiscr, sock, bfd->Sn.LocalPort);
@@ -192,12 +181,31 @@ bool bfdSocketSetup(bfdSessionInt *bfd)
   return true;
 }
 
+/*
+ * Get the local ports that have a receive socket.  Returns the number of
+ * ports, which may be more than 'max'.
+ */
+int bfdSocketGetPorts(uint16_t *ports, int max)
+{
+  bfdSockRec *sockRec;
+  int count = 0;
+
+  for (sockRec = sRxSocks; sockRec != NULL; sockRec = sockRec->next) {
+    if (count < max) {
+      ports[count] = sockRec->port;
+    }
+    count++;
+  }
+
+  return count;
+}
+
 bool bfdSocketClose(bfdSessionInt *bfd)
 {
   bfdSockRec *sockRec;
 
   if (bfd->TxSock > 0) {
-    close(bfd->TxSock);
+    tpCloseSkt(bfd->TxSock);
 
     bfdLog(LOG_DEBUG, "[%x] Closed socket %d to %s\n", bfd->LocalDiscr,
            bfd->TxSock, bfd->Sn.SnIdStr);
@@ -223,16 +231,17 @@ bool bfdSocketClose(bfdSessionInt *bfd)
           prev->next = cur->next;
         }
 
-        close(sockRec->sock);
-        tpRmSktActor(sockRec->sock);
+        tpCloseSkt(sockRec->sock);
 
         bfdLog(LOG_DEBUG, "[%x] Closed lonely Rx socket %d [*:%d]\n",
                bfd->LocalDiscr, sockRec->sock, bfd->Sn.LocalPort);
 
-        free(sockRec);
+        bfdPoolFree(&bfdSockRecPool, sockRec);
+
+        bfdPacketUpdateFilter();
       }
     } else {
-      close(bfd->RxSock);
+      tpCloseSkt(bfd->RxSock);
 
       bfdLog(LOG_DEBUG, "[%x] Closed Rx socket %d\n",
              bfd->LocalDiscr, bfd->RxSock);
@@ -0,0 +1,926 @@
+/* AF_XDP engine for control packets (see bfdPktIf.c).  A small XDP program is
+ * attached to the interface.  It redirects IPv4/UDP packets with TTL 255, no
+ * IP options and no fragmentation, sent to a local BFD port, to an AF_XDP
+ * socket for the receive queue they arrived on.  Everything else goes on to
+ * the stack as usual.
+ *
+ * Each socket has its own UMEM: half of the frames are kept on the fill ring
+ * for the kernel to receive into, the other half are used for transmission.
+ * Received frames are handed to bfdProcessPkt() in place and go back on the
+ * fill ring in one batch.  Control packets are written as complete
+ * Ethernet/IPv4/UDP frames into UMEM and queued on the Tx ring of the first
+ * socket; queued frames are sent with one sendto() per flush.
+ *
+ * With the fast path enabled, the program also keeps most packets from ever
+ * reaching the process.  In the Up state a peer sends the same packet over and
+ * over, so the last packet received for each Up session is put in a map keyed
+ * by Your Discriminator.  The program drops a packet that matches its entry
+ * after stamping the entry with the time; only changed packets (state, flags,
+ * intervals, ...) go to the XDP socket.  When the detection timer of such a
+ * session expires, the time stamp tells whether the peer has really gone
+ * quiet or the timer just needs to be started again.
+ *
+ * The XDP program is hand-assembled and loaded with the bpf() system call, so
+ * no BPF toolchain or library is needed.  It is attached in native mode if the
+ * driver supports it and in generic (skb) mode otherwise, which works on any
+ * interface, including veth.  The attachment is a BPF link, which the kernel
+ * removes when the process exits.  Linux 5.9 or later is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include "bfd.h"
+#include "bfdInt.h"
+#include "bfdLog.h"
+#include "tp-timers.h"
+
+#define UNUSED(x) { if(x){} }
+
+#if defined(XDP_USE_NEED_WAKEUP) && defined(__NR_bpf)
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* A ring shared with the kernel.  'idx' is our producer or consumer index. */
+typedef struct {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void     *ring;
+  void     *map;
+  size_t    mapLen;
+  uint32_t  idx;
+} bfdXdpRing;
+
+typedef struct {
+  struct _bfdXdpIf *ifp;
+  int        sock;
+  uint8_t   *umem;
+  bfdXdpRing fill;
+  bfdXdpRing comp;
+  bfdXdpRing rx;
+  bfdXdpRing tx;
+  uint64_t   txFree[BFD_XDPFRAMES / 2];  /* UMEM frames free for Tx */
+  uint32_t   txFreeCount;
+} bfdXdpQueue;
+
+typedef struct _bfdXdpIf {
+  bfdPktIf    pi;
+  int         progFd;
+  int         linkFd;
+  int         portsMapFd;
+  int         xsksMapFd;
+  uint16_t    ports[BFD_PKTMAXPORTS];   /* network order, as in the map */
+  int         nports;
+  int         nqueues;
+  bfdXdpQueue queues[BFD_XDPMAXQUEUES];
+} bfdXdpIf;
+
+/*
+ * Fast path map entry, keyed by the session's local discriminator in network
+ * order.  The XDP program updates 'lastSeen' (CLOCK_MONOTONIC, ns) and 'hits'.
+ */
+typedef struct {
+  uint8_t  pkt[BFD_MINPKTLEN];   /* last control packet from the peer */
+  uint32_t peer;                 /* peer address, network order */
+  uint32_t pad;
+  uint64_t lastSeen;
+  uint64_t hits;
+} bfdXdpSession;
+
+static bfdXdpIf xdpIfs[BFD_PKTMAXIFS];
+static int xdpIfCount;
+
+/* Shared by the programs on all interfaces */
+static int sessMapFd = -1;
+static bool fastPath;
+static uint64_t fastPathHits;
+static uint64_t fastPathUpdates;
+
+static bool bfdXdpSendFrame(bfdPktIf *pi, const uint8_t *hdr,
+                            const uint8_t *cp, size_t len);
+static void bfdXdpKick(bfdPktIf *pi);
+static void bfdXdpSetPorts(bfdPktIf *pi, const uint16_t *ports, int nports);
+static void bfdXdpGetStats(bfdPktIf *pi);
+
+static const bfdPktOps bfdXdpOps = {
+  .name     = "AF_XDP",
+  .send     = bfdXdpSendFrame,
+  .flush    = bfdXdpKick,
+  .setPorts = bfdXdpSetPorts,
+  .getStats = bfdXdpGetStats
+};
+
+static int bfdXdpBpf(int cmd, union bpf_attr *attr)
+{
+  return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int bfdXdpMapCreate(uint32_t type, uint32_t keySize, uint32_t valueSize,
+                           uint32_t maxEntries)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type    = type;
+  attr.key_size    = keySize;
+  attr.value_size  = valueSize;
+  attr.max_entries = maxEntries;
+
+  return bfdXdpBpf(BPF_MAP_CREATE, &attr);
+}
+
+static int bfdXdpMapUpdate(int fd, const void *key, const void *value)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t)fd;
+  attr.key    = (uint64_t)(uintptr_t)key;
+  attr.value  = (uint64_t)(uintptr_t)value;
+  attr.flags  = BPF_ANY;
+
+  return bfdXdpBpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int bfdXdpMapDelete(int fd, const void *key)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t)fd;
+  attr.key    = (uint64_t)(uintptr_t)key;
+
+  return bfdXdpBpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int bfdXdpMapLookup(int fd, const void *key, void *value)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t)fd;
+  attr.key    = (uint64_t)(uintptr_t)key;
+  attr.value  = (uint64_t)(uintptr_t)value;
+
+  return bfdXdpBpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+#define XDP_INSN(c, d, s, o, i) \
+  ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/*
+ * Load the XDP program.  In C it would read:
+ *
+ *   if (data + 42 > data_end)                        return XDP_PASS;
+ *   if (eth->h_proto != htons(ETH_P_IP))             return XDP_PASS;
+ *   if (ip->ihl_version != 0x45)                     return XDP_PASS;
+ *   if (ip->protocol != IPPROTO_UDP)                 return XDP_PASS;
+ *   if (ip->ttl != 255)                              return XDP_PASS;
+ *   if (ip->frag_off & htons(0x3fff))                return XDP_PASS;
+ *   if (!bpf_map_lookup_elem(&ports, &udp->dest))    return XDP_PASS;
+ *
+ *   if (data + 66 <= data_end && bfd->len == 24 &&
+ *       (s = bpf_map_lookup_elem(&sessions, &bfd->yourDiscr)) != NULL &&
+ *       memcmp(s->pkt, bfd, 24) == 0 && s->peer == ip->saddr)
+ *   {
+ *     s->lastSeen = bpf_ktime_get_ns();
+ *     __sync_fetch_and_add(&s->hits, 1);
+ *     return XDP_DROP;
+ *   }
+ *
+ *   return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+ *
+ * The packet comparison is done 4 bytes at a time.
+ */
+static int bfdXdpLoadProgram(bfdXdpIf *ifp)
+{
+  struct bpf_insn prog[] = {
+    /*  0 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+    /*  1 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 7, 6, offsetof(struct xdp_md, data), 0),
+    /*  2 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 8, 6, offsetof(struct xdp_md, data_end), 0),
+    /*  3 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 7, 0, 0),
+    /*  4 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, BFD_PKTHDRLEN),
+    /*  5 */ XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 8, 65, 0),
+    /*  6 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 7, 12, 0),
+    /*  7 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 63, htons(ETH_P_IP)),
+    /*  8 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 7, ETH_HLEN, 0),
+    /*  9 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 61, 0x45),
+    /* 10 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 7, ETH_HLEN + 9, 0),
+    /* 11 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 59, IPPROTO_UDP),
+    /* 12 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 7, ETH_HLEN + 8, 0),
+    /* 13 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 57, BFD_1HOPTTLVALUE),
+    /* 14 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 7, ETH_HLEN + 6, 0),
+    /* 15 */ XDP_INSN(BPF_JMP | BPF_JSET | BPF_K, 5, 0, 55, htons(0x3fff)),
+    /* 16 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_H, 5, 7, ETH_HLEN + 20 + 2, 0),
+    /* 17 */ XDP_INSN(BPF_STX | BPF_MEM | BPF_H, 10, 5, -2, 0),
+    /* 18 */ XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, ifp->portsMapFd),
+    /* 19 */ XDP_INSN(0, 0, 0, 0, 0),
+    /* 20 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+    /* 21 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -2),
+    /* 22 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+    /* 23 */ XDP_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 47, 0),
+    /* Fast path, unchanged packet for a known session */
+    /* 24 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 7, 0, 0),
+    /* 25 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, BFD_PKTHDRLEN + BFD_MINPKTLEN),
+    /* 26 */ XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 8, 38, 0),
+    /* 27 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_B, 5, 7, BFD_PKTHDRLEN + 3, 0),
+    /* 28 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 36, BFD_MINPKTLEN),
+    /* 29 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 7, BFD_PKTHDRLEN + 8, 0),
+    /* 30 */ XDP_INSN(BPF_STX | BPF_MEM | BPF_W, 10, 5, -8, 0),
+    /* 31 */ XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, sessMapFd),
+    /* 32 */ XDP_INSN(0, 0, 0, 0, 0),
+    /* 33 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+    /* 34 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -8),
+    /* 35 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+    /* 36 */ XDP_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 28, 0),
+    /* 37 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 9, 0, 0, 0),
+    /* 38 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN, 0),
+    /* 39 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 0, 0),
+    /* 40 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 24, 0),
+    /* 41 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN + 4, 0),
+    /* 42 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 4, 0),
+    /* 43 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 21, 0),
+    /* 44 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN + 8, 0),
+    /* 45 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 8, 0),
+    /* 46 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 18, 0),
+    /* 47 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN + 12, 0),
+    /* 48 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 12, 0),
+    /* 49 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 15, 0),
+    /* 50 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN + 16, 0),
+    /* 51 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 16, 0),
+    /* 52 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 12, 0),
+    /* 53 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, BFD_PKTHDRLEN + 20, 0),
+    /* 54 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, 20, 0),
+    /* 55 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 9, 0),
+    /* 56 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 4, 7, ETH_HLEN + 12, 0),
+    /* 57 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 5, 9, offsetof(bfdXdpSession, peer), 0),
+    /* 58 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_X, 4, 5, 6, 0),
+    /* 59 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns),
+    /* 60 */ XDP_INSN(BPF_STX | BPF_MEM | BPF_DW, 9, 0, offsetof(bfdXdpSession, lastSeen), 0),
+    /* 61 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1),
+    /* 62 */ XDP_INSN(BPF_STX | BPF_XADD | BPF_DW, 9, 1, offsetof(bfdXdpSession, hits), 0),
+    /* 63 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_DROP),
+    /* 64 */ XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    /* Everything else for a local port goes to the XDP socket */
+    /* 65 */ XDP_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+    /* 66 */ XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, ifp->xsksMapFd),
+    /* 67 */ XDP_INSN(0, 0, 0, 0, 0),
+    /* 68 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+    /* 69 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+    /* 70 */ XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    /* 71 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+    /* 72 */ XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+  };
+  static char verifierLog[4096];
+  union bpf_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns     = (uint64_t)(uintptr_t)prog;
+  attr.insn_cnt  = sizeof(prog) / sizeof(prog[0]);
+  attr.license   = (uint64_t)(uintptr_t)"GPL";
+
+  if ((fd = bfdXdpBpf(BPF_PROG_LOAD, &attr)) < 0 && errno == EACCES) {
+    /* Rejected by the verifier, load again to get its log */
+    attr.log_buf   = (uint64_t)(uintptr_t)verifierLog;
+    attr.log_size  = sizeof(verifierLog);
+    attr.log_level = 1;
+    if (bfdXdpBpf(BPF_PROG_LOAD, &attr) < 0) {
+      bfdLog(LOG_DEBUG, "XDP verifier log:\n%s\n", verifierLog);
+    }
+    errno = EACCES;
+  }
+
+  return fd;
+}
+
+static int bfdXdpAttach(bfdXdpIf *ifp, uint32_t mode)
+{
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd        = (uint32_t)ifp->progFd;
+  attr.link_create.target_ifindex = (uint32_t)ifp->pi.ifindex;
+  attr.link_create.attach_type    = BPF_XDP;
+  attr.link_create.flags          = mode;
+
+  return bfdXdpBpf(BPF_LINK_CREATE, &attr);
+}
+
+/*
+ * Number of receive queues of an interface, 1 if the driver doesn't say.
+ */
+static int bfdXdpQueueCount(const char *ifname)
+{
+  struct ethtool_channels ch;
+  struct ifreq ifr;
+  int sock, count = 1;
+
+  if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    return count;
+  }
+
+  memset(&ch, 0, sizeof(ch));
+  memset(&ifr, 0, sizeof(ifr));
+  ch.cmd = ETHTOOL_GCHANNELS;
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+  ifr.ifr_data = (char *)&ch;
+
+  if (ioctl(sock, SIOCETHTOOL, &ifr) == 0 && ch.rx_count + ch.combined_count > 0) {
+    count = (int)(ch.rx_count + ch.combined_count);
+  }
+
+  close(sock);
+  return count;
+}
+
+static bool bfdXdpMapRing(bfdXdpQueue *q, bfdXdpRing *r, struct xdp_ring_offset *off,
+                          size_t descSize, off_t pgoff)
+{
+  r->mapLen = off->desc + (BFD_XDPRINGSIZE * descSize);
+  r->map = mmap(NULL, r->mapLen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, q->sock, pgoff);
+  if (r->map == MAP_FAILED) {
+    r->map = NULL;
+    return false;
+  }
+
+  r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+  r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+  r->flags    = (uint32_t *)((uint8_t *)r->map + off->flags);
+  r->ring     = (uint8_t *)r->map + off->desc;
+  r->idx      = 0;
+
+  return true;
+}
+
+static void bfdXdpCloseQueue(bfdXdpQueue *q)
+{
+  bfdXdpRing *rings[] = { &q->fill, &q->comp, &q->rx, &q->tx };
+  size_t i;
+
+  for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+    if (rings[i]->map != NULL) {
+      munmap(rings[i]->map, rings[i]->mapLen);
+      rings[i]->map = NULL;
+    }
+  }
+  if (q->sock >= 0) {
+    close(q->sock);
+    q->sock = -1;
+  }
+  if (q->umem != NULL) {
+    munmap(q->umem, (size_t)BFD_XDPFRAMES * BFD_XDPFRAMESIZE);
+    q->umem = NULL;
+  }
+}
+
+/*
+ * Socket actor for an XDP socket: process every received frame, then put
+ * them all back on the fill ring.
+ */
+static void bfdXdpRead(int s, void *arg)
+{
+  bfdXdpQueue *q = arg;
+  struct xdp_desc *descs = q->rx.ring;
+  uint64_t *fill = q->fill.ring;
+  struct xdp_desc *d;
+  uint32_t prod, count, i;
+
+  UNUSED(s)
+
+  prod = __atomic_load_n(q->rx.producer, __ATOMIC_ACQUIRE);
+  count = prod - q->rx.idx;
+  if (count == 0) { return; }
+
+  for (i = 0; i < count; i++) {
+    d = &descs[(q->rx.idx + i) & (BFD_XDPRINGSIZE - 1)];
+    bfdPacketRxFrame(&q->ifp->pi, q->umem + d->addr, d->len);
+  }
+
+  /* The fill ring always has room for the frames we hold */
+  for (i = 0; i < count; i++) {
+    d = &descs[(q->rx.idx + i) & (BFD_XDPRINGSIZE - 1)];
+    fill[(q->fill.idx + i) & (BFD_XDPRINGSIZE - 1)] =
+      d->addr & ~(uint64_t)(BFD_XDPFRAMESIZE - 1);
+  }
+  q->fill.idx += count;
+  q->rx.idx += count;
+  __atomic_store_n(q->fill.producer, q->fill.idx, __ATOMIC_RELEASE);
+  __atomic_store_n(q->rx.consumer, q->rx.idx, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(q->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+    recvfrom(q->sock, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+  }
+
+  q->ifp->pi.rxBatches++;
+}
+
+static bool bfdXdpOpenQueue(bfdXdpIf *ifp, int queue)
+{
+  bfdXdpQueue *q = &ifp->queues[queue];
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sxdp;
+  socklen_t optlen = sizeof(off);
+  int ringSize = BFD_XDPRINGSIZE;
+  uint64_t *fill;
+  uint32_t i;
+
+  q->ifp = ifp;
+  q->sock = -1;
+
+  q->umem = mmap(NULL, (size_t)BFD_XDPFRAMES * BFD_XDPFRAMESIZE,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                 -1, 0);
+  if (q->umem == MAP_FAILED) {
+    q->umem = NULL;
+    bfdLog(LOG_ERR, "Can't allocate UMEM for %s queue %d: %m\n", ifp->pi.name, queue);
+    return false;
+  }
+
+  if ((q->sock = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+    bfdLog(LOG_ERR, "Can't create XDP socket for %s: %m\n", ifp->pi.name);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.addr       = (uint64_t)(uintptr_t)q->umem;
+  reg.len        = (uint64_t)BFD_XDPFRAMES * BFD_XDPFRAMESIZE;
+  reg.chunk_size = BFD_XDPFRAMESIZE;
+
+  if (setsockopt(q->sock, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+      setsockopt(q->sock, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) < 0 ||
+      setsockopt(q->sock, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) < 0 ||
+      setsockopt(q->sock, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) < 0 ||
+      setsockopt(q->sock, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) < 0 ||
+      getsockopt(q->sock, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+  {
+    bfdLog(LOG_ERR, "Can't set up XDP rings for %s queue %d: %m\n",
+           ifp->pi.name, queue);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  if (!bfdXdpMapRing(q, &q->fill, &off.fr, sizeof(uint64_t), (off_t)XDP_UMEM_PGOFF_FILL_RING) ||
+      !bfdXdpMapRing(q, &q->comp, &off.cr, sizeof(uint64_t), (off_t)XDP_UMEM_PGOFF_COMPLETION_RING) ||
+      !bfdXdpMapRing(q, &q->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+      !bfdXdpMapRing(q, &q->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING))
+  {
+    bfdLog(LOG_ERR, "Can't map XDP rings for %s queue %d: %m\n",
+           ifp->pi.name, queue);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  /* First half of UMEM receives, second half transmits */
+  fill = q->fill.ring;
+  for (i = 0; i < BFD_XDPFRAMES / 2; i++) {
+    fill[i] = (uint64_t)i * BFD_XDPFRAMESIZE;
+    q->txFree[i] = (uint64_t)(i + (BFD_XDPFRAMES / 2)) * BFD_XDPFRAMESIZE;
+  }
+  q->txFreeCount = BFD_XDPFRAMES / 2;
+  q->fill.idx = BFD_XDPFRAMES / 2;
+  __atomic_store_n(q->fill.producer, q->fill.idx, __ATOMIC_RELEASE);
+
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family   = AF_XDP;
+  sxdp.sxdp_flags    = XDP_USE_NEED_WAKEUP;
+  sxdp.sxdp_ifindex  = (uint32_t)ifp->pi.ifindex;
+  sxdp.sxdp_queue_id = (uint32_t)queue;
+
+  if (bind(q->sock, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+    bfdLog(LOG_ERR, "Can't bind XDP socket to %s queue %d: %m\n",
+           ifp->pi.name, queue);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  if (tpSetSktActor(q->sock, bfdXdpRead, q, NULL) < 0) {
+    bfdLog(LOG_ERR, "Can't add XDP socket for %s to event engine: %m\n",
+           ifp->pi.name);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  if (bfdXdpMapUpdate(ifp->xsksMapFd, &queue, &q->sock) < 0) {
+    bfdLog(LOG_ERR, "Can't add XDP socket for %s queue %d to map: %m\n",
+           ifp->pi.name, queue);
+    tpRmSktActor(q->sock);
+    bfdXdpCloseQueue(q);
+    return false;
+  }
+
+  return true;
+}
+
+static void bfdXdpCloseInterface(bfdXdpIf *ifp)
+{
+  int i;
+
+  for (i = 0; i < ifp->nqueues; i++) {
+    tpRmSktActor(ifp->queues[i].sock);
+    bfdXdpCloseQueue(&ifp->queues[i]);
+  }
+  if (ifp->linkFd >= 0)     { close(ifp->linkFd); }
+  if (ifp->progFd >= 0)     { close(ifp->progFd); }
+  if (ifp->xsksMapFd >= 0)  { close(ifp->xsksMapFd); }
+  if (ifp->portsMapFd >= 0) { close(ifp->portsMapFd); }
+}
+
+/*
+ * Bind the engine to an interface.  Must be called after the timers package
+ * has been initialized and before any sessions are created.
+ */
+bool bfdXdpAddInterface(const char *ifname)
+{
+  bfdXdpIf *ifp;
+  int queues;
+  int i;
+
+  if (xdpIfCount >= BFD_PKTMAXIFS) {
+    bfdLog(LOG_ERR, "Too many AF_XDP interfaces (max %d)\n", BFD_PKTMAXIFS);
+    return false;
+  }
+
+  ifp = &xdpIfs[xdpIfCount];
+  memset(ifp, 0, sizeof(bfdXdpIf));
+  ifp->pi.ops = &bfdXdpOps;
+  ifp->pi.filterUdp = false;
+  ifp->progFd = ifp->linkFd = ifp->portsMapFd = ifp->xsksMapFd = -1;
+  snprintf(ifp->pi.name, sizeof(ifp->pi.name), "%s", ifname);
+
+  if ((ifp->pi.ifindex = (int)if_nametoindex(ifname)) == 0) {
+    bfdLog(LOG_ERR, "Unknown interface %s: %m\n", ifname);
+    return false;
+  }
+
+  if ((queues = bfdXdpQueueCount(ifname)) > BFD_XDPMAXQUEUES) {
+    bfdLog(LOG_WARNING, "%s has %d Rx queues, packets on queues %d and up "
+           "will go through the stack\n", ifname, queues, BFD_XDPMAXQUEUES);
+    queues = BFD_XDPMAXQUEUES;
+  }
+
+  if (sessMapFd < 0) {
+    sessMapFd = bfdXdpMapCreate(BPF_MAP_TYPE_HASH, sizeof(uint32_t),
+                                sizeof(bfdXdpSession), BFD_XDPMAXSESSIONS);
+  }
+  ifp->portsMapFd = bfdXdpMapCreate(BPF_MAP_TYPE_HASH, sizeof(uint16_t),
+                                    sizeof(uint8_t), BFD_PKTMAXPORTS);
+  ifp->xsksMapFd = bfdXdpMapCreate(BPF_MAP_TYPE_XSKMAP, sizeof(int),
+                                   sizeof(int), BFD_XDPMAXQUEUES);
+  if (sessMapFd < 0 || ifp->portsMapFd < 0 || ifp->xsksMapFd < 0) {
+    bfdLog(LOG_ERR, "Can't create XDP maps for %s: %m\n", ifname);
+    bfdXdpCloseInterface(ifp);
+    return false;
+  }
+
+  if ((ifp->progFd = bfdXdpLoadProgram(ifp)) < 0) {
+    bfdLog(LOG_ERR, "Can't load XDP program for %s: %m\n", ifname);
+    bfdXdpCloseInterface(ifp);
+    return false;
+  }
+
+  if ((ifp->linkFd = bfdXdpAttach(ifp, XDP_FLAGS_DRV_MODE)) < 0 &&
+      (ifp->linkFd = bfdXdpAttach(ifp, XDP_FLAGS_SKB_MODE)) < 0)
+  {
+    bfdLog(LOG_ERR, "Can't attach XDP program to %s: %m\n", ifname);
+    bfdXdpCloseInterface(ifp);
+    return false;
+  }
+
+  for (i = 0; i < queues; i++) {
+    if (!bfdXdpOpenQueue(ifp, i)) {
+      bfdXdpCloseInterface(ifp);
+      return false;
+    }
+    ifp->nqueues++;
+  }
+
+  if (!bfdPacketRegister(&ifp->pi)) {
+    bfdXdpCloseInterface(ifp);
+    return false;
+  }
+
+  xdpIfCount++;
+
+  bfdLog(LOG_NOTICE, "AF_XDP engine on %s: %d queues, %d UMEM frames each%s\n",
+         ifname, queues, BFD_XDPFRAMES, fastPath ? ", fast path" : "");
+
+  return true;
+}
+
+/*
+ * Redirect the given destination ports to the XDP sockets.  Ports that don't
+ * fit in the map go through the stack and the UDP sockets.
+ */
+static void bfdXdpSetPorts(bfdPktIf *pi, const uint16_t *ports, int nports)
+{
+  bfdXdpIf *ifp = (bfdXdpIf *)pi;
+  uint8_t one = 1;
+  uint16_t port;
+  int i;
+
+  for (i = 0; i < ifp->nports; i++) {
+    bfdXdpMapDelete(ifp->portsMapFd, &ifp->ports[i]);
+  }
+
+  if (nports > BFD_PKTMAXPORTS) { nports = BFD_PKTMAXPORTS; }
+
+  for (ifp->nports = 0, i = 0; i < nports; i++) {
+    port = htons(ports[i]);
+    if (bfdXdpMapUpdate(ifp->portsMapFd, &port, &one) < 0) {
+      bfdLog(LOG_WARNING, "Can't redirect port %d on %s: %m\n", ports[i], pi->name);
+      continue;
+    }
+    ifp->ports[ifp->nports++] = port;
+  }
+}
+
+/*
+ * Take back the Tx frames the kernel is done with.
+ */
+static void bfdXdpReclaim(bfdXdpQueue *q)
+{
+  uint64_t *comp = q->comp.ring;
+  uint32_t prod;
+
+  prod = __atomic_load_n(q->comp.producer, __ATOMIC_ACQUIRE);
+  while (q->comp.idx != prod) {
+    q->txFree[q->txFreeCount++] = comp[q->comp.idx & (BFD_XDPRINGSIZE - 1)];
+    q->comp.idx++;
+  }
+  __atomic_store_n(q->comp.consumer, q->comp.idx, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write a frame into UMEM and queue it on the Tx ring.  Returns false if no
+ * frame or descriptor is free.
+ */
+static bool bfdXdpSendFrame(bfdPktIf *pi, const uint8_t *hdr,
+                            const uint8_t *cp, size_t len)
+{
+  bfdXdpQueue *q = &((bfdXdpIf *)pi)->queues[0];
+  struct xdp_desc *descs = q->tx.ring;
+  struct xdp_desc *d;
+  uint64_t addr;
+
+  if (q->txFreeCount == 0) {
+    bfdXdpReclaim(q);
+    if (q->txFreeCount == 0) {
+      return false;
+    }
+  }
+
+  if (q->tx.idx - __atomic_load_n(q->tx.consumer, __ATOMIC_ACQUIRE) >= BFD_XDPRINGSIZE) {
+    return false;
+  }
+
+  addr = q->txFree[--q->txFreeCount];
+  memcpy(q->umem + addr, hdr, BFD_PKTHDRLEN);
+  memcpy(q->umem + addr + BFD_PKTHDRLEN, cp, len);
+
+  d = &descs[q->tx.idx & (BFD_XDPRINGSIZE - 1)];
+  d->addr = addr;
+  d->len = (uint32_t)(BFD_PKTHDRLEN + len);
+  d->options = 0;
+  q->tx.idx++;
+
+  return true;
+}
+
+/*
+ * Publish the queued Tx descriptors and have the kernel send them.
+ */
+static void bfdXdpKick(bfdPktIf *pi)
+{
+  bfdXdpQueue *q = &((bfdXdpIf *)pi)->queues[0];
+
+  __atomic_store_n(q->tx.producer, q->tx.idx, __ATOMIC_RELEASE);
+
+  if ((__atomic_load_n(q->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) &&
+      sendto(q->sock, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+      errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+  {
+    bfdLog(LOG_WARNING, "Error sending on AF_XDP socket %s: %m\n", pi->name);
+  }
+
+  bfdXdpReclaim(q);
+}
+
+static void bfdXdpGetStats(bfdPktIf *pi)
+{
+  bfdXdpIf *ifp = (bfdXdpIf *)pi;
+  struct xdp_statistics st;
+  socklen_t len;
+  int i;
+
+  /* Kernel counters are cumulative */
+  pi->rxDrops = 0;
+  for (i = 0; i < ifp->nqueues; i++) {
+    len = sizeof(st);
+    if (getsockopt(ifp->queues[i].sock, SOL_XDP, XDP_STATISTICS, &st, &len) == 0) {
+      pi->rxDrops += st.rx_dropped + st.rx_ring_full + st.rx_invalid_descs;
+    }
+  }
+}
+
+/*
+ * Have the XDP programs drop packets from the peer that are the same as the
+ * last one received.  Must be called before the interfaces are added.
+ */
+void bfdXdpEnableFastPath(void)
+{
+  fastPath = true;
+}
+
+static uint64_t bfdXdpNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Take the hits of a session's fast path entry before it is replaced.
+ */
+static void bfdXdpSessionHits(uint32_t key)
+{
+  bfdXdpSession s;
+
+  if (bfdXdpMapLookup(sessMapFd, &key, &s) == 0) {
+    fastPathHits += s.hits;
+  }
+}
+
+/*
+ * Called for each packet of an Up session that reached the state machine
+ * through an XDP socket.  Such a packet is different from the last one, so
+ * it becomes the one the XDP program looks for.  Packets with the Poll bit
+ * are always passed up, so that each of them gets a Final.
+ */
+void bfdXdpSessionUpdate(bfdSessionInt *bfd, bfdRxPkt *pkt)
+{
+  bfdXdpSession s;
+  uint32_t key;
+
+  if (!fastPath || pkt->pktIf == NULL || pkt->pktIf->ops != &bfdXdpOps) {
+    return;
+  }
+
+  if (CPKT_GET_POLL(pkt->cp) || CPKT_GET_LEN(pkt->cp) != BFD_MINPKTLEN) {
+    bfdXdpSessionRemove(bfd);
+    return;
+  }
+
+  key = htonl(bfd->LocalDiscr);
+  if (bfd->FastPath) {
+    bfdXdpSessionHits(key);
+  }
+
+  memset(&s, 0, sizeof(s));
+  memcpy(s.pkt, pkt->cp, BFD_MINPKTLEN);
+  s.peer = pkt->src->sin_addr.s_addr;
+  s.lastSeen = bfdXdpNow();
+
+  if (bfdXdpMapUpdate(sessMapFd, &key, &s) < 0) {
+    bfdLog(LOG_DEBUG, "[%x] Can't add session to XDP fast path: %m\n",
+           bfd->LocalDiscr);
+    bfd->FastPath = false;
+    return;
+  }
+
+  if (!bfd->FastPath) {
+    bfdLog(LOG_INFO, "[%x] Packets from %s now checked in XDP fast path\n",
+           bfd->LocalDiscr, bfd->Sn.SnIdStr);
+  }
+  bfd->FastPath = true;
+  fastPathUpdates++;
+}
+
+/*
+ * Pass all packets of a session up again, when it leaves the Up state or is
+ * destroyed.
+ */
+void bfdXdpSessionRemove(bfdSessionInt *bfd)
+{
+  uint32_t key;
+
+  if (!bfd->FastPath) { return; }
+
+  key = htonl(bfd->LocalDiscr);
+  bfdXdpSessionHits(key);
+  bfdXdpMapDelete(sessMapFd, &key);
+  bfd->FastPath = false;
+}
+
+/*
+ * Microseconds since the XDP program last saw a packet of the session, or
+ * since its entry was last updated.
+ */
+uint32_t bfdXdpSessionIdle(bfdSessionInt *bfd)
+{
+  bfdXdpSession s;
+  uint32_t key = htonl(bfd->LocalDiscr);
+  uint64_t now, idle;
+
+  if (!bfd->FastPath || bfdXdpMapLookup(sessMapFd, &key, &s) < 0) {
+    return UINT32_MAX;
+  }
+
+  now = bfdXdpNow();
+  if (s.lastSeen >= now) { return 0; }
+
+  idle = (now - s.lastSeen) / 1000;
+  return (idle > UINT32_MAX) ? UINT32_MAX : (uint32_t)idle;
+}
+
+void bfdXdpLogCounters(void)
+{
+  bfdXdpSession s;
+  uint32_t key, next;
+  uint64_t hits = fastPathHits;
+  union bpf_attr attr;
+  void *prev = NULL;
+  int count = 0;
+
+  if (!fastPath || sessMapFd < 0) { return; }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = (uint32_t)sessMapFd;
+  attr.next_key = (uint64_t)(uintptr_t)&next;
+
+  for (;;) {
+    attr.key = (uint64_t)(uintptr_t)prev;
+    if (bfdXdpBpf(BPF_MAP_GET_NEXT_KEY, &attr) < 0) { break; }
+    key = next;
+    prev = &key;
+    if (bfdXdpMapLookup(sessMapFd, &key, &s) == 0) {
+      hits += s.hits;
+      count++;
+    }
+  }
+
+  bfdLog(LOG_NOTICE, "XDP fast path: %d sessions, %" PRIu64 " pkts dropped in "
+         "kernel, %" PRIu64 " updates\n", count, hits, fastPathUpdates);
+}
+
+#else  /* XDP_USE_NEED_WAKEUP && __NR_bpf */
+
+/* Kernel headers are too old for this engine */
+bool bfdXdpAddInterface(const char *ifname)
+{
+  bfdLog(LOG_ERR, "AF_XDP engine not supported in this build (%s)\n", ifname);
+  return false;
+}
+
+void bfdXdpEnableFastPath(void)
+{
+}
+
+void bfdXdpSessionUpdate(bfdSessionInt *bfd, bfdRxPkt *pkt)
+{
+  UNUSED(bfd)
+  UNUSED(pkt)
+}
+
+void bfdXdpSessionRemove(bfdSessionInt *bfd)
+{
+  UNUSED(bfd)
+}
+
+uint32_t bfdXdpSessionIdle(bfdSessionInt *bfd)
+{
+  UNUSED(bfd)
+  return UINT32_MAX;
+}
+
+void bfdXdpLogCounters(void)
+{
+}
+
+#endif  /* XDP_USE_NEED_WAKEUP && __NR_bpf */
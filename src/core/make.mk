@@ -3,3 +3,10 @@ SRCS += tp-timers.c
 SRCS += bfdLog.c
 SRCS += bfdSockets.c
 SRCS += bfdUtils.c
+SRCS += bfdRt.c
+SRCS += tp-uring.c
+SRCS += bfdPacket.c
+SRCS += bfdPktIf.c
+SRCS += bfdXdp.c
+SRCS += bfdCmd.c
+SRCS += bfdNotify.c
@@ -1,12 +1,24 @@
 /* Timer and socket support routines.  This module uses an event
  * model.  There are two types of objects that generate events - timers and sockets.
  * Timers generate an event when they expire.  Sockets generate an event when there
- * is data available to read.
+ * is data available to read.  Datagram sockets may instead be given a datagram
+ * actor, which is handed each received datagram.
+ *
+ * Waiting for socket events, receiving datagrams and sending them is done by an
+ * event engine: select() by default, or io_uring (see tp-uring.c).
  *
  * Applications using this module should open intial sockets and set the socket
  * actor routines (using timSetSktActor), optionally start timers, and then call
  * timDoEventLoop.  timDoEventLoop never returns, but calls the appropriate socket
  * actor or timer actor routines when the events occur.
+ *
+ * All of this state belongs to an event loop (tpLoop).  A process has a
+ * default loop and may create more, e.g. one per thread.  The functions that
+ * don't take a loop argument work on the calling thread's current loop, and
+ * actors always run with their own loop current.  An application that has an
+ * event loop of its own can embed a tp loop in it instead of calling
+ * tpDoEventLoop(): it watches the descriptor returned by tpLoopGetFd(), wakes
+ * up at the time returned by tpLoopNextDeadline(), and calls tpLoopRunOnce().
  */
 
 #include <stdio.h>
@@ -18,36 +30,44 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include "avl.h"
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #define TP_PRIVATE
-#include "tp-timers.h"
+#include "tpInt.h"
 
 /*
- * Active timers are kept in an AVL tree (also known as a balanced binary tree).
- * This tree is sorted by expiration time, that is, the "first" node in the tree
- * (not the same as the root node) is the timer that will expire first.  The
- * advantage of AVL trees is that the worst case insertion, deletion and search
- * is proportional to the log, base 2, of the number of nodes.  That makes it very
- * efficient for managing a large number of items, and should allow us to connect
- * to tens of thousands of MTAs without significant performance impact.
+ * Active timers are kept in a binary min-heap ordered by expiration time, that
+ * is, the root of the heap is always the timer that will expire first.
+ * Insertion and removal are proportional to the log, base 2, of the number of
+ * timers, and each timer records its own position in the heap so it can be
+ * stopped without a search.
  *
- * The AVL trees are implemented using the GNU libavl.  Documentation is in
- * avl-1.4.0/avl.html.
+ * The heap is a flat array of timer pointers that only grows when it is full,
+ * so starting and stopping timers never allocates memory once enough slots
+ * have been reserved (see tpReserveTimers).
  */
-static avl_tree *timerTree;
-
-static tpSktActor sktActors[TP_MAXSKTS];
-static void *sktArgs[TP_MAXSKTS];
-static fd_set sktSet;
-static int maxSkt;
 
-static int caughtSignal;
-static sigset_t caughtSigset;
-static sigset_t activeSigset;
-static tpSigActor sigActors[TP_MAXSIGNALS];
+/* Select engine: readiness is polled with select() */
+static const tpEngineOps tpSelectEngine = {
+  .name   = "select",
+  .init   = NULL,
+  .fini   = tpSelectFini,
+  .addSkt = tpSelectAddSkt,
+  .rmSkt  = tpSelectRmSkt,
+  .sendTo = tpSelectSendTo,
+  .flush  = NULL,
+  .wait   = tpSelectWait,
+  .getFd  = tpSelectGetFd
+};
 
-/* Flag for kicking out of event loop. */
-static int exitEventLoopRequest;
+static tpLoop defaultLoop = {
+  .engine  = &tpSelectEngine,
+  .epollFd = -1,
+  .sigFd   = -1
+};
+static __thread tpLoop *curLoop;
 
 /*
  * tpSetSktActor - set the socket actor function for a given socket.
@@ -64,20 +84,46 @@ static int exitEventLoopRequest;
  */
 int tpSetSktActor(int skt, tpSktActor actor, void *arg, tpSktActor *old)
 {
+  tpLoop *loop = tpLoopGetCurrent();
+
   if (skt >= TP_MAXSKTS || skt < 0) {
     errno = EBADF;
     return(-1);
   }
   if (old != NULL) {
-    *old = sktActors[skt];
+    *old = loop->sktActors[skt];
   }
-  sktActors[skt] = actor;
-  sktArgs[skt] = arg;
-  FD_SET(skt, &sktSet);
-  if (skt >= maxSkt) {
-    maxSkt = skt + 1;
+  loop->sktActors[skt] = actor;
+  loop->dgramActors[skt] = NULL;
+  loop->sktArgs[skt] = arg;
+  return(loop->engine->addSkt(loop, skt, 0));
+}
+
+/*
+ * tpSetDgramActor - set the datagram actor function for a given socket.
+ *
+ * Parameters:      skt - the (datagram) socket.
+ *                  actor - the datagram actor function.
+ *                  arg - an argument to send to the actor function.
+ *
+ * Returns:         <0 on error (errno set).
+ *
+ * Side effects:    Datagrams arriving on the socket are received by the event
+ *                  engine and handed to the actor function, along with the
+ *                  source address and ancillary data.
+ */
+int tpSetDgramActor(int skt, tpDgramActor actor, void *arg)
+{
+  tpLoop *loop = tpLoopGetCurrent();
+
+  if (skt >= TP_MAXSKTS || skt < 0) {
+    errno = EBADF;
+    return(-1);
   }
-  return(0);
+  loop->sktActors[skt] = NULL;
+  loop->dgramActors[skt] = actor;
+  loop->sktArgs[skt] = arg;
+  return(loop->engine->addSkt(loop, skt, 1));
 }
 
 /*
@@ -91,41 +137,357 @@ int tpSetSktActor(int skt, tpSktActor actor, void *arg, tpSktActor *old)
  */
 int tpRmSktActor(int skt)
 {
+  tpLoop *loop = tpLoopGetCurrent();
+
   if (skt >= TP_MAXSKTS || skt < 0) {
     errno = EBADF;
     return(-1);
   }
-  sktActors[skt] = NULL;
-  sktArgs[skt] = NULL;
-  FD_CLR(skt, &sktSet);
+  loop->sktActors[skt] = NULL;
+  loop->dgramActors[skt] = NULL;
+  loop->sktArgs[skt] = NULL;
+  loop->engine->rmSkt(loop, skt);
   return(0);
 }
 
 /*
- * tpSetSignalActor - set actor function for EINTR actions
+ * tpSendTo - send a datagram.
+ *
+ * Parameters:     skt - the socket to send on.
+ *                 buf, len - the datagram.
+ *                 to, tolen - the destination address.
+ *
+ * Returns:        <0 on error (errno set).
+ *
+ * Comments:       Engines may queue the datagram and send it together with
+ *                 others at the end of the event loop iteration; errors
+ *                 reported after the call returns are counted in
+ *                 tpStats.txErrors.
+ */
+int tpSendTo(int skt, const void *buf, size_t len,
+             const struct sockaddr *to, socklen_t tolen)
+{
+  tpLoop *loop = tpLoopGetCurrent();
+
+  return(loop->engine->sendTo(loop, skt, buf, len, to, tolen));
+}
+
+/*
+ * tpCloseSkt - remove a socket's actor and close it.
+ *
+ * Parameters:     skt - the socket.
+ *
+ * Returns:        <0 on error (errno set).
+ *
+ * Comments:       Datagrams queued on the socket with tpSendTo() are handed
+ *                 to the kernel first, so that they can't end up on another
+ *                 socket that reuses the descriptor.
+ */
+int tpCloseSkt(int skt)
+{
+  tpLoop *loop = tpLoopGetCurrent();
+
+  if (skt >= 0 && skt < TP_MAXSKTS &&
+      (loop->sktActors[skt] != NULL || loop->dgramActors[skt] != NULL)) {
+    tpRmSktActor(skt);
+  }
+  if (loop->engine->flush != NULL) {
+    loop->engine->flush(loop);
+  }
+  return(close(skt));
+}
+
+/*
+ * tpSetEngine - select the event engine of the current loop.
+ *
+ * Parameters:     type - the engine to use.
+ *
+ * Returns:        <0 on error (errno set), in which case the current engine
+ *                 remains in use.
+ *
+ * Comments:       Must be called after tpInitTimers() and before any socket
+ *                 actors are set.
+ */
+int tpSetEngine(tpEngineType type)
+{
+  return(tpLoopSetEngine(tpLoopGetCurrent(), type));
+}
+
+static int tpLoopSetEngine(tpLoop *loop, tpEngineType type)
+{
+  const tpEngineOps *ops, *old = loop->engine;
+
+  switch (type) {
+  case TP_ENGINE_SELECT:
+    ops = &tpSelectEngine;
+    break;
+  case TP_ENGINE_URING:
+    ops = &tpUringEngine;
+    break;
+  default:
+    errno = EINVAL;
+    return(-1);
+  }
+  if (ops == old) {
+    return(0);
+  }
+  if (ops->init != NULL && ops->init(loop) < 0) {
+    return(-1);
+  }
+  if (old->fini != NULL) {
+    old->fini(loop);
+  }
+  loop->engine = ops;
+  return(0);
+}
+
+/*
+ * tpGetEngineName - get the name of the event engine in use.
+ */
+const char *tpGetEngineName(void)
+{
+  return(tpLoopGetCurrent()->engine->name);
+}
+
+/*
+ * tpGetStats - get event engine and timer counters of the current loop.
+ */
+void tpGetStats(tpStats *stats)
+{
+  *stats = tpLoopGetCurrent()->stats;
+}
+
+/*
+ * tpDispatchDgram - hand a received datagram to the socket's actor.
+ */
+void tpDispatchDgram(tpLoop *loop, int skt, struct msghdr *msg, ssize_t len)
+{
+  if (loop->dgramActors[skt] != NULL) {
+    if (len >= 0) {
+      loop->stats.rxDgrams++;
+    }
+    loop->dgramActors[skt](skt, msg, len, loop->sktArgs[skt]);
+  }
+}
+
+/*
+ * tpDispatchSkt - handle a socket that has read data available.
+ *
+ * Comments:       Datagram sockets are read here and the datagram is handed
+ *                 to the datagram actor; other sockets are handed to their
+ *                 socket actor, which reads the data itself.
+ */
+void tpDispatchSkt(tpLoop *loop, int skt)
+{
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t len;
+
+  if (loop->sktActors[skt] != NULL) {
+    loop->sktActors[skt](skt, loop->sktArgs[skt]);
+  } else if (loop->dgramActors[skt] != NULL) {
+    iov.iov_base = loop->dgramBuf;
+    iov.iov_len = sizeof(loop->dgramBuf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &loop->dgramAddr;
+    msg.msg_namelen = sizeof(loop->dgramAddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = loop->dgramCtl;
+    msg.msg_controllen = sizeof(loop->dgramCtl);
+    loop->stats.syscalls++;
+    len = recvmsg(skt, &msg, 0);
+    tpDispatchDgram(loop, skt, &msg, len);
+  }
+}
+
+/*
+ * Select engine: readiness is polled with select(), datagrams are read with
+ * one recvmsg() and sent with one sendto() each.  If the loop is embedded,
+ * the sockets are also kept in an epoll set that the application can watch.
+ */
+static int tpSelectAddSkt(tpLoop *loop, int skt, int dgram)
+{
+  struct epoll_event ev;
+
+  (void)dgram;
+
+  if (loop->epollFd >= 0 && !FD_ISSET(skt, &loop->sktSet)) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = skt;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, skt, &ev) < 0) {
+      return(-1);
+    }
+  }
+  FD_SET(skt, &loop->sktSet);
+  if (skt >= loop->maxSkt) {
+    loop->maxSkt = skt + 1;
+  }
+  return(0);
+}
+
+static void tpSelectRmSkt(tpLoop *loop, int skt)
+{
+  if (loop->epollFd >= 0 && FD_ISSET(skt, &loop->sktSet)) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, skt, NULL);
+  }
+  FD_CLR(skt, &loop->sktSet);
+}
+
+static int tpSelectSendTo(tpLoop *loop, int skt, const void *buf, size_t len,
+                          const struct sockaddr *to, socklen_t tolen)
+{
+  loop->stats.syscalls++;
+  if (sendto(skt, buf, len, 0, to, tolen) < 0) {
+    loop->stats.txErrors++;
+    return(-1);
+  }
+  loop->stats.txDgrams++;
+  return(0);
+}
+
+static int tpSelectWait(tpLoop *loop, struct timeval *timeout)
+{
+  fd_set rdset;
+  int n, i;
+
+  /*
+   * Use 'select' to wait until the next timer expires (time untill next
+   * timer is in 'timeout', NULL if no timers are active), or until
+   * some of the sockets have read data available.
+   */
+  memcpy(&rdset, &loop->sktSet, sizeof(rdset));
+  loop->stats.syscalls++;
+  n = select(loop->maxSkt, &rdset, NULL, NULL, timeout);
+  if (n > 0) {
+    /* Some sockets have data, find which ones */
+    for (i = 0; i < loop->maxSkt; ++i) {
+      if (FD_ISSET(i, &rdset)) {
+        tpDispatchSkt(loop, i);
+        if (--n <= 0) break;
+      }
+    }
+  } else if (n < 0) {
+    return(-1);
+  }
+  /* N == 0 indicates timeout. */
+  return(0);
+}
+
+static int tpSelectGetFd(tpLoop *loop)
+{
+  struct epoll_event ev;
+  int i;
+
+  if (loop->epollFd >= 0) {
+    return(loop->epollFd);
+  }
+  if ((loop->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    return(-1);
+  }
+  for (i = 0; i < loop->maxSkt; i++) {
+    if (FD_ISSET(i, &loop->sktSet)) {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = i;
+      epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, i, &ev);
+    }
+  }
+  return(loop->epollFd);
+}
+
+static void tpSelectFini(tpLoop *loop)
+{
+  if (loop->epollFd >= 0) {
+    close(loop->epollFd);
+    loop->epollFd = -1;
+  }
+  FD_ZERO(&loop->sktSet);
+  loop->maxSkt = 0;
+}
+
+/*
+ * tpSetSignalActor - set actor function for a signal.
  *
  * Parameters:        actor - actor function to set
+ *                    sig - the signal.
+ *
+ * Returns:           <0 on error (errno set).
  *
- * Returns:           0 always
+ * Comments:          The signal is blocked and delivered through a signalfd
+ *                    that is read like any other socket, so the actor runs
+ *                    from the event loop and checking for signals costs
+ *                    nothing when none are pending.
  */
 int tpSetSignalActor(tpSigActor actor, int sig)
 {
-  struct sigaction sa;
+  tpLoop *loop = tpLoopGetCurrent();
+  sigset_t set;
+  int fd;
 
-  if (sig >= TP_MAXSIGNALS) {
+  if (sig <= 0 || sig >= TP_MAXSIGNALS) {
+    errno = EINVAL;
+    return(-1);
+  }
+  set = loop->activeSigset;
+  sigaddset(&set, sig);
+  if ((fd = signalfd(loop->sigFd, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
     return(-1);
   }
-  sigActors[sig] = actor;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = tpSigHandler;
-  sigaction(sig, &sa, NULL);
+  if (loop->sigFd < 0) {
+    if (tpSetSktActor(fd, tpReadSignals, loop, NULL) < 0) {
+      close(fd);
+      return(-1);
+    }
+    loop->sigFd = fd;
+  }
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  loop->activeSigset = set;
+  loop->sigActors[sig] = actor;
   return(0);
 }
 
-static void tpSigHandler(int sig)
+/*
+ * tpSetFlushActor - set an actor function to run before each wait for events.
+ *
+ * Parameters:        actor - actor function to set.
+ *                    arg - an argument to send to the actor function.
+ *
+ * Returns:           <0 on error (errno set).
+ *
+ * Comments:          Lets a module batch work (e.g. packet transmission) that
+ *                    was queued by socket and timer actors during an event
+ *                    loop iteration.
+ */
+int tpSetFlushActor(tpFlushActor actor, void *arg)
+{
+  tpLoop *loop = tpLoopGetCurrent();
+
+  if (loop->flushCount >= TP_MAXFLUSHACTORS) {
+    errno = ENOSPC;
+    return(-1);
+  }
+  loop->flushActors[loop->flushCount] = actor;
+  loop->flushArgs[loop->flushCount] = arg;
+  loop->flushCount++;
+  return(0);
+}
+
+/*
+ * tpReadSignals - socket actor for the signalfd, call the actors of the
+ *                 pending signals.
+ */
+static void tpReadSignals(int skt, void *arg)
 {
-  caughtSignal = 1;
-  sigaddset(&caughtSigset, sig);
+  tpLoop *loop = arg;
+  struct signalfd_siginfo si;
+
+  while (read(skt, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+    if (si.ssi_signo < TP_MAXSIGNALS && loop->sigActors[si.ssi_signo] != NULL) {
+      loop->sigActors[si.ssi_signo]((int)si.ssi_signo);
+    }
+  }
 }
 
 /*
@@ -155,19 +517,116 @@ static int tpCompareTime(tpTimer *t1, tpTimer *t2)
 }
 
 /*
- * tpInsertTimer - insert a timer into the AVL tree.
+ * tpGrowTimers - grow a loop's timer heap to hold 'capacity' timers.
+ *
+ * Returns:         <0 on error (errno set).
+ *
+ * Side effects:    The new slots are written so that the pages backing them
+ *                  are faulted in now rather than on first use.
+ */
+static int tpGrowTimers(tpLoop *loop, uint32_t capacity)
+{
+  tpTimer **heap;
+
+  if (capacity <= loop->timerCapacity) {
+    return(0);
+  }
+  if ((heap = realloc(loop->timerHeap, capacity * sizeof(tpTimer *))) == NULL) {
+    return(-1);
+  }
+  memset(heap + loop->timerCapacity, 0,
+         (capacity - loop->timerCapacity) * sizeof(tpTimer *));
+  loop->timerHeap = heap;
+  loop->timerCapacity = capacity;
+  loop->stats.timerAllocs++;
+  return(0);
+}
+
+/*
+ * tpHeapSet - place a timer in a heap slot.
+ */
+static void tpHeapSet(tpLoop *loop, uint32_t idx, tpTimer *t)
+{
+  loop->timerHeap[idx] = t;
+  t->heapIdx = idx;
+}
+
+/*
+ * tpHeapUp - move a timer towards the root until its parent expires first.
+ */
+static void tpHeapUp(tpLoop *loop, uint32_t idx)
+{
+  tpTimer *t = loop->timerHeap[idx];
+  uint32_t parent;
+
+  while (idx > 0) {
+    parent = (idx - 1) / 2;
+    if (tpCompareTime(loop->timerHeap[parent], t) <= 0) {
+      break;
+    }
+    tpHeapSet(loop, idx, loop->timerHeap[parent]);
+    idx = parent;
+  }
+  tpHeapSet(loop, idx, t);
+}
+
+/*
+ * tpHeapDown - move a timer away from the root until both children expire
+ *              after it.
  */
-static void tpInsertTimer(tpTimer *t)
+static void tpHeapDown(tpLoop *loop, uint32_t idx)
 {
-  avl_insert(timerTree, (void *)t);
+  tpTimer *t = loop->timerHeap[idx];
+  uint32_t child;
+
+  while ((child = (2 * idx) + 1) < loop->timerCount) {
+    if ((child + 1) < loop->timerCount &&
+        tpCompareTime(loop->timerHeap[child + 1], loop->timerHeap[child]) < 0) {
+      child++;
+    }
+    if (tpCompareTime(t, loop->timerHeap[child]) <= 0) {
+      break;
+    }
+    tpHeapSet(loop, idx, loop->timerHeap[child]);
+    idx = child;
+  }
+  tpHeapSet(loop, idx, t);
 }
 
 /*
- * tpRemoveTimer - remove a timer from the AVL tree.
+ * tpInsertTimer - insert a timer into a loop's heap.
+ */
+static void tpInsertTimer(tpLoop *loop, tpTimer *t)
+{
+  if (loop->timerCount == loop->timerCapacity &&
+      tpGrowTimers(loop, loop->timerCapacity ? loop->timerCapacity * 2 : TP_MINTIMERS) < 0) {
+    fprintf(stderr, "Unable to grow timer heap: %s\n", strerror(errno));
+    exit(1);
+  }
+  t->loop = loop;
+  tpHeapSet(loop, loop->timerCount++, t);
+  tpHeapUp(loop, t->heapIdx);
+}
+
+/*
+ * tpRemoveTimer - remove a timer from the heap of its loop.
  */
 static void tpRemoveTimer(tpTimer *t)
 {
-  avl_delete(timerTree, (void *)t);
+  tpLoop *loop = t->loop;
+  uint32_t idx = t->heapIdx;
+  tpTimer *last;
+
+  if (loop == NULL || idx >= loop->timerCount || loop->timerHeap[idx] != t) {
+    return;
+  }
+  last = loop->timerHeap[--loop->timerCount];
+  loop->timerHeap[loop->timerCount] = NULL;
+  if (last != t) {
+    tpHeapSet(loop, idx, last);
+    tpHeapDown(loop, idx);
+    tpHeapUp(loop, last->heapIdx);
+  }
 }
 
 /*
@@ -296,7 +755,7 @@ void tpStartTimer(tpTimer *t, struct timeval *timeout,
   t->action = action;
   t->arg = arg;
   t->running = 1;
-  tpInsertTimer(t);
+  tpInsertTimer(tpLoopGetCurrent(), t);
 }
 
 /*
@@ -344,102 +803,92 @@ int64_t tpGetTimeRemaining(tpTimer *t)
 /*
  * tpCheckTimers - check for expired timers.
  *
- * Returns:         Time until next unexpired timer will expire.
- *                  NULL if no timers are active.
+ * Parameters:      loop - the loop whose timers to check.
+ *                  now - the current time, NULL to read the clock.
+ *                  next - where to return the time until the next unexpired
+ *                         timer will expire.
+ *
+ * Returns:         'next', NULL if no timers are active.
  *
  * Side effects:    Calls actor functions for timers that have reached
- *                  expiration time.  Removes expired timers from AVL tree.
+ *                  expiration time.  Removes expired timers from the heap.
  */
-static struct timeval *tpCheckTimers(void)
+static struct timeval *tpCheckTimers(tpLoop *loop, const struct timeval *now,
+                                     struct timeval *next)
 {
-  avl_traverser trav = AVL_TRAVERSER_INIT;
-  tpTimer now, *t;
-  static struct timeval nextExpire;
+  tpTimer cur, *t = NULL;
 
-  gettimeofday(&(now.expiresAt), NULL);
-  while ((t = (tpTimer *)avl_traverse(timerTree, &trav)) != NULL) {
-    if (tpCompareTime(t, &now) <= 0) {
+  if (now != NULL) {
+    cur.expiresAt = *now;
+  } else {
+    gettimeofday(&(cur.expiresAt), NULL);
+  }
+  while (loop->timerCount > 0) {
+    t = loop->timerHeap[0];
+    if (tpCompareTime(t, &cur) <= 0) {
       /* Timer has expired */
       t->running = 0;
       tpRemoveTimer(t);
       t->action(t, t->arg);
+      t = NULL;
     } else {
       /* No more timers to expire */
       break;
     }
-    avl_init_traverser(&trav);
   }
   if (t != NULL) {
     /* Calculate time until next timer expires */
-    gettimeofday(&(now.expiresAt), NULL);
-    tpSubtractTime(t, &now, &nextExpire);
-    return(&nextExpire);
+    gettimeofday(&(cur.expiresAt), NULL);
+    tpSubtractTime(t, &cur, next);
+    return(next);
   } else {
     return(NULL);
   }
 }
 
-static void tpCheckSignals(void)
+/*
+ * tpRunFlushActors - push out work queued by the actors.
+ */
+static void tpRunFlushActors(tpLoop *loop)
 {
   int i;
 
-  sigprocmask(SIG_BLOCK, &activeSigset, NULL);
-  if (caughtSignal) {
-    for (i = 0; i < TP_MAXSIGNALS; ++i) {
-      if (sigismember(&caughtSigset, i) && sigActors[i]) {
-        sigActors[i](i);
-      }
-    }
-    sigemptyset(&caughtSigset);
-    caughtSignal = 0;
+  for (i = 0; i < loop->flushCount; i++) {
+    loop->flushActors[i](loop->flushArgs[i]);
   }
-  sigprocmask(SIG_UNBLOCK, &activeSigset, NULL);
 }
 
 /*
- * tpStopEventLoop - Set flag so that event loop exits.
+ * tpStopEventLoop - Set flag so that the current loop's event loop exits.
  */
 void tpStopEventLoop(void)
 {
-    exitEventLoopRequest = 1;
+  tpLoopGetCurrent()->exitRequest = 1;
 }
 
 /*
- * tpDoEventLoop - monitor for events and call actor functions.
+ * tpDoEventLoop - monitor for events and call actor functions, in the
+ *                 current loop.
  */
 void tpDoEventLoop(void)
 {
-  fd_set rdset;
-  int n, i;
-  struct timeval *nextTimer;
+  tpLoop *loop = tpLoopGetCurrent();
+  struct timeval next, *nextTimer;
 
   /* Receive and respond to events */
-  while (exitEventLoopRequest == 0) {
+  while (loop->exitRequest == 0) {
     /* Check for expired timers */
-    nextTimer = tpCheckTimers();
-    /* Check for signals */
-    tpCheckSignals();
+    nextTimer = tpCheckTimers(loop, NULL, &next);
+    /* Push out work queued by the actors */
+    tpRunFlushActors(loop);
     /*
-     * Use 'select' to wait until the next timer expires (time untill next
-     * timer is in 'nextTimer', NULL if no timers are active), or until
-     * some of the sockets have read data available.
+     * Let the engine wait until the next timer expires or some of the
+     * sockets have read data available, and call their actors.
      */
-    memcpy(&rdset, &sktSet, sizeof(rdset));
-    n = select(maxSkt, &rdset, NULL, NULL, nextTimer);
-    if (n > 0) {
-      /* Some sockets have data, find which ones */
-      for (i = 0; i < TP_MAXSKTS; ++i) {
-        if (FD_ISSET(i, &rdset)) {
-          if (sktActors[i] != NULL) {
-            sktActors[i](i, sktArgs[i]);
-          }
-          if (--n <= 0) break;
-        }
-      }
-    } else if (n < 0) {
+    if (loop->engine->wait(loop, nextTimer) < 0) {
       if (errno == EINTR) { continue; }
 
-      fprintf(stderr, "Error in select(): %s\n", strerror(errno));
+      fprintf(stderr, "Error in %s engine: %s\n", loop->engine->name, strerror(errno));
 
       /* FIXME: This is most likely not the desired behaviour in
          production. Need to figure out which error are recoverable
@@ -450,24 +899,23 @@ void tpDoEventLoop(void)
          of the problem. */
       exit(1);
     }
-    /* N == 0 indicates timeout. */
   }
+  loop->exitRequest = 0;
 }
 
 /*
- * tpTimerCompare - compare expiration time of two timers.
+ * tpReserveTimers - make room for a number of simultaneously running timers
+ *                   in the current loop.
  *
- * Parameters:       a, b - timers to compare.
- *                   p - unused.
+ * Parameters:       count - number of timers to reserve heap slots for.
  *
- * Returns:          -1, 0, 1 - for 'a' expiration time less than, equal to,
- *                   or greater than 'b', respectively.
+ * Returns:          <0 on error (errno set).
  *
- * Comments:         Used by AVL library as avl_comparison_function.
+ * Comments:         Starting up to 'count' timers will not allocate memory.
  */
-static int tpTimerCompare(const void *a, const void *b, void *p)
+int tpReserveTimers(uint32_t count)
 {
-  return(tpCompareTime((tpTimer *)a, (tpTimer *)b));
+  return(tpGrowTimers(tpLoopGetCurrent(), count));
 }
 
 /*
@@ -478,5 +926,163 @@ static int tpTimerCompare(const void *a, const void *b, void *p)
  */
 void tpInitTimers(void)
 {
-  timerTree = avl_create(tpTimerCompare, NULL);
+  if (tpGrowTimers(tpLoopGetCurrent(), TP_MINTIMERS) < 0) {
+    fprintf(stderr, "Unable to allocate timer heap: %s\n", strerror(errno));
+    exit(1);
+  }
+}
+
+static void tpLoopInit(tpLoop *loop)
+{
+  memset(loop, 0, sizeof(*loop));
+  loop->engine = &tpSelectEngine;
+  loop->epollFd = -1;
+  loop->sigFd = -1;
+}
+
+/*
+ * tpLoopCreate - create an event loop.
+ *
+ * Parameters:       type - the event engine to use.
+ *
+ * Returns:          the loop, NULL on error (errno set).
+ *
+ * Comments:         Make the loop current (tpLoopSetCurrent) to set its
+ *                   actors and start its timers.
+ */
+tpLoop *tpLoopCreate(tpEngineType type)
+{
+  tpLoop *loop;
+
+  if ((loop = malloc(sizeof(*loop))) == NULL) {
+    return(NULL);
+  }
+  tpLoopInit(loop);
+  if (tpGrowTimers(loop, TP_MINTIMERS) < 0 ||
+      tpLoopSetEngine(loop, type) < 0) {
+    free(loop->timerHeap);
+    free(loop);
+    return(NULL);
+  }
+  return(loop);
+}
+
+/*
+ * tpLoopDestroy - destroy an event loop created with tpLoopCreate().
+ *
+ * Comments:         Timers still running in the loop are stopped.  Sockets
+ *                   are not closed, but are no longer watched.
+ */
+void tpLoopDestroy(tpLoop *loop)
+{
+  uint32_t i;
+
+  if (loop == NULL || loop == &defaultLoop) {
+    return;
+  }
+  for (i = 0; i < loop->timerCount; i++) {
+    loop->timerHeap[i]->running = 0;
+    loop->timerHeap[i]->loop = NULL;
+  }
+  if (loop->sigFd >= 0) {
+    close(loop->sigFd);
+  }
+  if (loop->engine->fini != NULL) {
+    loop->engine->fini(loop);
+  }
+  if (curLoop == loop) {
+    curLoop = NULL;
+  }
+  free(loop->timerHeap);
+  free(loop);
+}
+
+/*
+ * tpLoopSetCurrent - make a loop the calling thread's current loop.
+ *
+ * Parameters:       loop - the loop, NULL for the default loop.
+ *
+ * Returns:          the loop that was current.
+ */
+tpLoop *tpLoopSetCurrent(tpLoop *loop)
+{
+  tpLoop *prev = tpLoopGetCurrent();
+
+  curLoop = loop;
+  return(prev);
+}
+
+/*
+ * tpLoopGetCurrent - get the calling thread's current loop.
+ */
+tpLoop *tpLoopGetCurrent(void)
+{
+  return(curLoop != NULL ? curLoop : &defaultLoop);
+}
+
+/*
+ * tpLoopGetFd - get a descriptor to embed a loop in another event loop.
+ *
+ * Returns:          a descriptor that is readable when the loop has events
+ *                   to handle, <0 on error (errno set).
+ *
+ * Comments:         The descriptor belongs to the loop.  When it is readable,
+ *                   call tpLoopRunOnce().
+ */
+int tpLoopGetFd(tpLoop *loop)
+{
+  return(loop->engine->getFd(loop));
+}
+
+/*
+ * tpLoopNextDeadline - get the time the next timer of a loop expires.
+ *
+ * Parameters:       loop - the loop.
+ *                   deadline - where to return the expiration time, on the
+ *                              gettimeofday() clock.
+ *
+ * Returns:          1 if 'deadline' was set, 0 if no timers are running.
+ *
+ * Comments:         Call tpLoopRunOnce() once the deadline has passed.
+ */
+int tpLoopNextDeadline(tpLoop *loop, struct timeval *deadline)
+{
+  if (loop->timerCount == 0) {
+    return(0);
+  }
+  *deadline = loop->timerHeap[0]->expiresAt;
+  return(1);
+}
+
+/*
+ * tpLoopRunOnce - handle the events of a loop without waiting.
+ *
+ * Parameters:       loop - the loop.
+ *                   now - the current time on the gettimeofday() clock,
+ *                         NULL to read the clock.
+ *
+ * Returns:          <0 on error (errno set).
+ *
+ * Comments:         Calls the actors of sockets with read data and of
+ *                   timers that have expired at 'now', then pushes out what
+ *                   the actors queued.  The loop is current while its actors
+ *                   run.
+ */
+int tpLoopRunOnce(tpLoop *loop, const struct timeval *now)
+{
+  struct timeval zero = { 0, 0 }, next;
+  tpLoop *prev = tpLoopSetCurrent(loop);
+  int ret;
+
+  if ((ret = loop->engine->wait(loop, &zero)) < 0 && errno == EINTR) {
+    ret = 0;
+  }
+  tpCheckTimers(loop, now, &next);
+  tpRunFlushActors(loop);
+  if (loop->engine->flush != NULL) {
+    loop->engine->flush(loop);
+  }
+
+  tpLoopSetCurrent(prev);
+  return(ret);
 }
@@ -0,0 +1,604 @@
+/* io_uring event engine for the tp-timers package.
+ *
+ * Instead of polling for readiness and then reading each datagram with its own
+ * system call, a multishot recvmsg request is kept armed on every datagram
+ * socket.  The kernel picks a buffer from a provided buffer ring, fills it with
+ * the source address, ancillary data and payload, and posts a completion; the
+ * completions are handed to the datagram actors straight from the ring
+ * buffers, which are then given back to the kernel.
+ *
+ * Datagrams sent with tpSendTo() are queued as sendmsg requests and submitted
+ * together, in the same io_uring_enter() call that waits for the next
+ * completion or for the next timer deadline.  Under load one system call per
+ * loop iteration therefore covers every datagram received and sent during the
+ * iteration.
+ *
+ * Sockets that have a plain socket actor (monitor connections and the like) get
+ * a multishot poll request instead, and their actor is called on readiness just
+ * as with the select engine.
+ *
+ * The engine talks to the kernel directly (no liburing) and needs Linux 6.0 or
+ * later for multishot recvmsg and provided buffer rings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "tpInt.h"
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define TP_URING_ENTRIES    1024       /* Submission queue entries */
+#define TP_URING_BUFS       512        /* Receive buffers, power of 2 */
+#define TP_URING_BUFSZ      (sizeof(struct io_uring_recvmsg_out) + \
+                             sizeof(struct sockaddr_in) + TP_MAXDGRAMCTL + \
+                             TP_MAXDGRAM)
+#define TP_URING_BGID       1          /* Buffer group used for receives */
+#define TP_URING_SENDS      512        /* Sends that can be in flight */
+
+/*
+ * Request user_data: kind in the top byte, socket generation in the next 24
+ * bits and the socket (or send slot) in the low 32 bits.  Completions whose
+ * generation does not match the socket's current one belong to a socket that
+ * has since been removed and are dropped.
+ */
+#define TP_URING_KIND_CANCEL  0
+#define TP_URING_KIND_POLL    1
+#define TP_URING_KIND_RECV    2
+#define TP_URING_KIND_SEND    3
+#define TP_URING_UDATA(kind, gen, idx)  (((uint64_t)(kind) << 56) |          \
+                                         (((uint64_t)(gen) & 0xffffff) << 32) | \
+                                         (uint32_t)(idx))
+#define TP_URING_UDATA_KIND(ud)         ((uint32_t)((ud) >> 56))
+#define TP_URING_UDATA_GEN(ud)          ((uint32_t)(((ud) >> 32) & 0xffffff))
+#define TP_URING_UDATA_IDX(ud)          ((uint32_t)((ud) & 0xffffffff))
+
+typedef struct {
+  uint32_t gen;        /* bumped each time the socket is removed */
+  uint8_t  armed;      /* kind of the request armed for the socket, 0 if none */
+  uint8_t  dgram;      /* socket has a datagram actor */
+  uint8_t  pollOnly;   /* multishot recvmsg unsupported, poll and recvmsg */
+} tpUringSkt;
+
+typedef struct {
+  struct msghdr      msg;
+  struct iovec       iov;
+  struct sockaddr_in to;
+  uint8_t            buf[TP_MAXDGRAM];
+  int                next;         /* free list link */
+} tpUringSend;
+
+/* Engine state of a loop */
+typedef struct {
+  int ringFd;
+  uint8_t *ring;                /* SQ and CQ rings, mapped together */
+  size_t ringSz;
+  unsigned sqEntries;
+
+  /* Submission queue */
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  struct io_uring_sqe *sqes;
+  unsigned sqLocalTail;
+
+  /* Completion queue */
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  /* Provided receive buffers */
+  struct io_uring_buf_ring *bufRing;
+  uint8_t *bufBase;
+  uint16_t bufTail;
+
+  /* Template for multishot receives: sizes of the name and control areas */
+  struct msghdr recvTmpl;
+
+  tpUringSkt skts[TP_MAXSKTS];
+  tpUringSend sends[TP_URING_SENDS];
+  int freeSend;
+} tpUringState;
+
+static void tpUringRmSkt(tpLoop *loop, int skt);
+
+static int tpUringEnter(tpLoop *loop, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags, void *arg, size_t argSz)
+{
+  tpUringState *u = loop->engineState;
+
+  loop->stats.syscalls++;
+  return((int)syscall(__NR_io_uring_enter, u->ringFd, toSubmit, minComplete,
+                      flags, arg, argSz));
+}
+
+/*
+ * Make queued submissions visible to the kernel.  Returns how many are
+ * waiting to be submitted.
+ */
+static unsigned tpUringPublish(tpUringState *u)
+{
+  __atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+  return(u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Get a free submission queue entry, submitting what is queued if the
+ * submission queue is full.
+ */
+static struct io_uring_sqe *tpUringGetSqe(tpLoop *loop)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+
+  if (u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) > u->sqMask) {
+    if (tpUringEnter(loop, tpUringPublish(u), 0, 0, NULL, 0) < 0) {
+      return(NULL);
+    }
+    if (u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) > u->sqMask) {
+      errno = EBUSY;
+      return(NULL);
+    }
+  }
+  idx = u->sqLocalTail & u->sqMask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sqArray[idx] = idx;
+  u->sqLocalTail++;
+  return(sqe);
+}
+
+/*
+ * Give a receive buffer (back) to the kernel.
+ */
+static void tpUringAddBuf(tpUringState *u, uint16_t bid)
+{
+  struct io_uring_buf *buf = &u->bufRing->bufs[u->bufTail & (TP_URING_BUFS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(u->bufBase + ((size_t)bid * TP_URING_BUFSZ));
+  buf->len = (uint32_t)TP_URING_BUFSZ;
+  buf->bid = bid;
+  u->bufTail++;
+  __atomic_store_n(&u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE);
+}
+
+static int tpUringArm(tpLoop *loop, int skt)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = tpUringGetSqe(loop)) == NULL) {
+    return(-1);
+  }
+  sqe->fd = skt;
+  if (u->skts[skt].dgram && !u->skts[skt].pollOnly) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&u->recvTmpl;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TP_URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    u->skts[skt].armed = TP_URING_KIND_RECV;
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    u->skts[skt].armed = TP_URING_KIND_POLL;
+  }
+  sqe->user_data = TP_URING_UDATA(u->skts[skt].armed, u->skts[skt].gen, skt);
+  return(0);
+}
+
+static int tpUringAddSkt(tpLoop *loop, int skt, int dgram)
+{
+  tpUringState *u = loop->engineState;
+
+  if (u->skts[skt].armed) {
+    if (u->skts[skt].dgram == dgram) {
+      return(0);
+    }
+    tpUringRmSkt(loop, skt);
+  }
+  u->skts[skt].dgram = (uint8_t)dgram;
+  u->skts[skt].pollOnly = 0;
+  return(tpUringArm(loop, skt));
+}
+
+static void tpUringRmSkt(tpLoop *loop, int skt)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_sqe *sqe;
+  uint64_t udata;
+
+  if (!u->skts[skt].armed) {
+    return;
+  }
+  udata = TP_URING_UDATA(u->skts[skt].armed, u->skts[skt].gen, skt);
+  u->skts[skt].armed = 0;
+  u->skts[skt].gen++;
+  if ((sqe = tpUringGetSqe(loop)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = udata;
+    sqe->user_data = TP_URING_UDATA(TP_URING_KIND_CANCEL, 0, 0);
+  }
+}
+
+static int tpUringSendTo(tpLoop *loop, int skt, const void *buf, size_t len,
+                         const struct sockaddr *to, socklen_t tolen)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_sqe *sqe;
+  tpUringSend *snd;
+  int slot;
+
+  if (u->freeSend < 0 || len > TP_MAXDGRAM || tolen > sizeof(snd->to) ||
+      (sqe = tpUringGetSqe(loop)) == NULL) {
+    /* Can't queue it, send it right away */
+    loop->stats.syscalls++;
+    if (sendto(skt, buf, len, 0, to, tolen) < 0) {
+      loop->stats.txErrors++;
+      return(-1);
+    }
+    loop->stats.txDgrams++;
+    return(0);
+  }
+
+  slot = u->freeSend;
+  snd = &u->sends[slot];
+  u->freeSend = snd->next;
+
+  memcpy(snd->buf, buf, len);
+  memcpy(&snd->to, to, tolen);
+  snd->iov.iov_base = snd->buf;
+  snd->iov.iov_len = len;
+  memset(&snd->msg, 0, sizeof(snd->msg));
+  snd->msg.msg_name = &snd->to;
+  snd->msg.msg_namelen = tolen;
+  snd->msg.msg_iov = &snd->iov;
+  snd->msg.msg_iovlen = 1;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = skt;
+  sqe->addr = (uint64_t)(uintptr_t)&snd->msg;
+  sqe->len = 1;
+  sqe->user_data = TP_URING_UDATA(TP_URING_KIND_SEND, 0, slot);
+  return(0);
+}
+
+/*
+ * Submit everything that is queued without waiting.
+ */
+static void tpUringFlush(tpLoop *loop)
+{
+  unsigned toSubmit = tpUringPublish(loop->engineState);
+
+  if (toSubmit > 0) {
+    tpUringEnter(loop, toSubmit, 0, 0, NULL, 0);
+  }
+}
+
+/*
+ * Hand a completed receive to the datagram actor, decoding the
+ * io_uring_recvmsg_out layout of the buffer into a msghdr.
+ */
+static void tpUringRecvDone(tpLoop *loop, int skt, struct io_uring_cqe *cqe)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_recvmsg_out *out;
+  struct msghdr msg;
+  struct iovec iov;
+  uint8_t *buf, *payload;
+  uint16_t bid;
+  size_t hdrLen;
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+  bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  buf = u->bufBase + ((size_t)bid * TP_URING_BUFSZ);
+  out = (struct io_uring_recvmsg_out *)buf;
+  hdrLen = sizeof(*out) + u->recvTmpl.msg_namelen + u->recvTmpl.msg_controllen;
+  payload = buf + hdrLen;
+
+  iov.iov_base = payload;
+  iov.iov_len = (size_t)cqe->res - hdrLen;
+  if (iov.iov_len > out->payloadlen) {
+    iov.iov_len = out->payloadlen;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = buf + sizeof(*out);
+  msg.msg_namelen = (out->namelen < u->recvTmpl.msg_namelen) ?
+                      out->namelen : u->recvTmpl.msg_namelen;
+  msg.msg_control = buf + sizeof(*out) + u->recvTmpl.msg_namelen;
+  msg.msg_controllen = (out->controllen < u->recvTmpl.msg_controllen) ?
+                         out->controllen : u->recvTmpl.msg_controllen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_flags = (int)out->flags;
+
+  tpDispatchDgram(loop, skt, &msg, (ssize_t)iov.iov_len);
+
+  tpUringAddBuf(u, bid);
+}
+
+static void tpUringComplete(tpLoop *loop, struct io_uring_cqe *cqe)
+{
+  tpUringState *u = loop->engineState;
+  uint32_t kind = TP_URING_UDATA_KIND(cqe->user_data);
+  uint32_t idx = TP_URING_UDATA_IDX(cqe->user_data);
+  int skt = (int)idx;
+
+  switch (kind) {
+  case TP_URING_KIND_SEND:
+    if (cqe->res < 0) {
+      loop->stats.txErrors++;
+    } else {
+      loop->stats.txDgrams++;
+    }
+    u->sends[idx].next = u->freeSend;
+    u->freeSend = (int)idx;
+    return;
+  case TP_URING_KIND_POLL:
+  case TP_URING_KIND_RECV:
+    break;
+  default:
+    return;
+  }
+
+  if (skt < 0 || skt >= TP_MAXSKTS ||
+      TP_URING_UDATA_GEN(cqe->user_data) != (u->skts[skt].gen & 0xffffff) ||
+      u->skts[skt].armed != kind) {
+    /* Stale completion for a removed socket; recycle the buffer */
+    if (kind == TP_URING_KIND_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+      tpUringAddBuf(u, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+    return;
+  }
+
+  if (kind == TP_URING_KIND_RECV) {
+    if (cqe->res >= 0) {
+      tpUringRecvDone(loop, skt, cqe);
+    } else if (cqe->res == -EINVAL) {
+      /* Kernel can't do multishot recvmsg here, fall back to poll */
+      u->skts[skt].pollOnly = 1;
+    } else if (cqe->res != -ENOBUFS) {
+      errno = -cqe->res;
+      tpDispatchDgram(loop, skt, NULL, -1);
+    }
+  } else if (cqe->res >= 0) {
+    tpDispatchSkt(loop, skt);
+  }
+
+  /* The actor may have removed the socket; otherwise re-arm if needed */
+  if (!(cqe->flags & IORING_CQE_F_MORE) &&
+      u->skts[skt].armed == kind &&
+      TP_URING_UDATA_GEN(cqe->user_data) == (u->skts[skt].gen & 0xffffff)) {
+    tpUringArm(loop, skt);
+  }
+}
+
+static int tpUringWait(tpLoop *loop, struct timeval *timeout)
+{
+  tpUringState *u = loop->engineState;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct io_uring_cqe *cqe;
+  unsigned head, toSubmit;
+  int ret;
+
+  toSubmit = tpUringPublish(u);
+  if (__atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE) == *u->cqHead) {
+    /* Nothing to do yet: submit and wait for a completion or the timer */
+    memset(&arg, 0, sizeof(arg));
+    if (timeout != NULL) {
+      ts.tv_sec = timeout->tv_sec;
+      ts.tv_nsec = timeout->tv_usec * 1000;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    ret = tpUringEnter(loop, toSubmit, 1,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EBUSY) {
+      return(-1);
+    }
+  } else if (toSubmit > 0) {
+    if (tpUringEnter(loop, toSubmit, 0, 0, NULL, 0) < 0 && errno != EBUSY) {
+      return(-1);
+    }
+  }
+
+  head = *u->cqHead;
+  while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+    cqe = &u->cqes[head & u->cqMask];
+    head++;
+    __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+    tpUringComplete(loop, cqe);
+  }
+  return(0);
+}
+
+/*
+ * Unmap and close whatever tpUringInit() set up, and free the state.
+ */
+static void tpUringFini(tpLoop *loop)
+{
+  tpUringState *u = loop->engineState;
+
+  if (u == NULL) {
+    return;
+  }
+  if (u->bufBase != NULL && u->bufBase != MAP_FAILED) {
+    munmap(u->bufBase, TP_URING_BUFS * TP_URING_BUFSZ);
+  }
+  if (u->bufRing != NULL && u->bufRing != MAP_FAILED) {
+    munmap(u->bufRing, TP_URING_BUFS * sizeof(struct io_uring_buf));
+  }
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqEntries * sizeof(struct io_uring_sqe));
+  }
+  if (u->ring != NULL && u->ring != MAP_FAILED) {
+    munmap(u->ring, u->ringSz);
+  }
+  if (u->ringFd >= 0) {
+    close(u->ringFd);
+  }
+  free(u);
+  loop->engineState = NULL;
+}
+
+/*
+ * Set up the ring, map it, and register the provided receive buffers.
+ */
+static int tpUringInit(tpLoop *loop)
+{
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  tpUringState *u;
+  uint8_t *sq, *cq;
+  size_t cqSz;
+  int i, err;
+
+  if ((u = calloc(1, sizeof(*u))) == NULL) {
+    return(-1);
+  }
+  u->ringFd = -1;
+  u->freeSend = -1;
+  loop->engineState = u;
+
+  memset(&p, 0, sizeof(p));
+  if ((u->ringFd = (int)syscall(__NR_io_uring_setup, TP_URING_ENTRIES, &p)) < 0) {
+    goto fail;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  u->ringSz = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+  cqSz = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+  if (cqSz > u->ringSz) {
+    u->ringSz = cqSz;
+  }
+  u->ring = mmap(NULL, u->ringSz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->ringFd, IORING_OFF_SQ_RING);
+  if (u->ring == MAP_FAILED) {
+    goto fail;
+  }
+  sq = cq = u->ring;
+  u->sqEntries = p.sq_entries;
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 u->ringFd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    goto fail;
+  }
+
+  u->sqHead  = (unsigned *)(sq + p.sq_off.head);
+  u->sqTail  = (unsigned *)(sq + p.sq_off.tail);
+  u->sqMask  = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->sqArray = (unsigned *)(sq + p.sq_off.array);
+  u->sqLocalTail = *u->sqTail;
+  u->cqHead  = (unsigned *)(cq + p.cq_off.head);
+  u->cqTail  = (unsigned *)(cq + p.cq_off.tail);
+  u->cqMask  = *(unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* Provided buffer ring and the buffers themselves */
+  u->bufRing = mmap(NULL, TP_URING_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  u->bufBase = mmap(NULL, TP_URING_BUFS * TP_URING_BUFSZ, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (u->bufRing == MAP_FAILED || u->bufBase == MAP_FAILED) {
+    errno = ENOMEM;
+    goto fail;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)u->bufRing;
+  reg.ring_entries = TP_URING_BUFS;
+  reg.bgid = TP_URING_BGID;
+  loop->stats.syscalls++;
+  if (syscall(__NR_io_uring_register, u->ringFd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    goto fail;
+  }
+
+  u->bufTail = 0;
+  for (i = 0; i < TP_URING_BUFS; i++) {
+    tpUringAddBuf(u, (uint16_t)i);
+  }
+
+  memset(&u->recvTmpl, 0, sizeof(u->recvTmpl));
+  u->recvTmpl.msg_namelen = sizeof(struct sockaddr_in);
+  u->recvTmpl.msg_controllen = TP_MAXDGRAMCTL;
+
+  for (i = TP_URING_SENDS - 1; i >= 0; i--) {
+    u->sends[i].next = u->freeSend;
+    u->freeSend = i;
+  }
+
+  return(0);
+
+fail:
+  err = errno;
+  tpUringFini(loop);
+  errno = err;
+  return(-1);
+}
+
+/*
+ * The ring descriptor polls readable while completions are waiting.
+ */
+static int tpUringGetFd(tpLoop *loop)
+{
+  tpUringState *u = loop->engineState;
+
+  return(u->ringFd);
+}
+
+#else  /* IORING_RECV_MULTISHOT */
+
+/* Kernel headers are too old for this engine */
+static int tpUringInit(tpLoop *loop)
+{
+  errno = ENOSYS;
+  return(-1);
+}
+
+static void tpUringFini(tpLoop *loop) { }
+static int tpUringAddSkt(tpLoop *loop, int skt, int dgram) { return(-1); }
+static void tpUringRmSkt(tpLoop *loop, int skt) { }
+static int tpUringSendTo(tpLoop *loop, int skt, const void *buf, size_t len,
+                         const struct sockaddr *to, socklen_t tolen)
+{
+  return(-1);
+}
+static void tpUringFlush(tpLoop *loop) { }
+static int tpUringWait(tpLoop *loop, struct timeval *timeout) { return(-1); }
+static int tpUringGetFd(tpLoop *loop) { return(-1); }
+
+#endif  /* IORING_RECV_MULTISHOT */
+
+const tpEngineOps tpUringEngine = {
+  .name   = "io_uring",
+  .init   = tpUringInit,
+  .fini   = tpUringFini,
+  .addSkt = tpUringAddSkt,
+  .rmSkt  = tpUringRmSkt,
+  .sendTo = tpUringSendTo,
+  .flush  = tpUringFlush,
+  .wait   = tpUringWait,
+  .getFd  = tpUringGetFd
+};
@@ -0,0 +1,71 @@
+/* Internal definitions shared by the tp-timers package and its event
+ * engines.
+ */
+
+#ifndef _TP_INT_H_
+#define _TP_INT_H_
+
+#include <sys/select.h>
+#include <netinet/in.h>
+#include "tp-timers.h"
+
+typedef struct _tpEngineOps {
+  const char *name;
+  int  (*init)(tpLoop *loop);               /* NULL if nothing to set up */
+  void (*fini)(tpLoop *loop);               /* NULL if nothing to tear down */
+  int  (*addSkt)(tpLoop *loop, int skt, int dgram);  /* start watching a socket */
+  void (*rmSkt)(tpLoop *loop, int skt);     /* stop watching a socket */
+  int  (*sendTo)(tpLoop *loop, int skt, const void *buf, size_t len,
+                 const struct sockaddr *to, socklen_t tolen);
+  void (*flush)(tpLoop *loop);              /* hand queued requests to kernel */
+  int  (*wait)(tpLoop *loop, struct timeval *timeout);  /* wait for and dispatch events */
+  int  (*getFd)(tpLoop *loop);              /* descriptor readable when events are pending */
+} tpEngineOps;
+
+/*
+ * An event loop: its timers, sockets, signals and engine.
+ */
+struct _tpLoop {
+  const tpEngineOps *engine;
+  void *engineState;            /* owned by the engine, NULL for select */
+  tpStats stats;
+
+  /* Timer heap, see tp-timers.c */
+  tpTimer **timerHeap;
+  uint32_t timerCount;
+  uint32_t timerCapacity;
+
+  tpSktActor sktActors[TP_MAXSKTS];
+  tpDgramActor dgramActors[TP_MAXSKTS];
+  void *sktArgs[TP_MAXSKTS];
+
+  /* Select engine */
+  fd_set sktSet;
+  int maxSkt;
+  int epollFd;                  /* mirror of sktSet for embedding, -1 if none */
+
+  /* Receive buffers for datagram sockets that are read with recvmsg() */
+  uint8_t dgramBuf[TP_MAXDGRAM];
+  uint8_t dgramCtl[TP_MAXDGRAMCTL];
+  struct sockaddr_in dgramAddr;
+
+  /* Signals with an actor are blocked and read from a signalfd */
+  int sigFd;
+  sigset_t activeSigset;
+  tpSigActor sigActors[TP_MAXSIGNALS];
+
+  /* Called once per event loop iteration, before waiting for events */
+  tpFlushActor flushActors[TP_MAXFLUSHACTORS];
+  void *flushArgs[TP_MAXFLUSHACTORS];
+  int flushCount;
+
+  /* Flag for kicking out of event loop. */
+  int exitRequest;
+};
+
+extern const tpEngineOps tpUringEngine;
+
+void tpDispatchSkt(tpLoop *loop, int skt);
+void tpDispatchDgram(tpLoop *loop, int skt, struct msghdr *msg, ssize_t len);
+
+#endif  /* _TP_INT_H_ */
@@ -18,6 +18,8 @@
 #define BFD_ADDR_STR_SZ 20
 #define BFD_SN_ID_STR_SZ 60
 
+#define BFD_PKTMAXIFS 8   /* Interfaces the packet engines can be bound to */
+
 typedef enum {
   BFDSTATE_ADMINDOWN = 0,
   BFDSTATE_DOWN      = 1,
@@ -40,6 +42,11 @@ typedef enum {
 typedef void* bfdSubHndl;
 typedef void (*bfdSubCB)(bfdState state, void *arg);
 
+/* Completion of a command posted from another thread (see bfdCmd.c).
+ * 'hndl' is the new handle for bfdCmdSubscribe(), NULL otherwise.
+ */
+typedef void (*bfdCmdCB)(bool ok, bfdSubHndl hndl, void *arg);
+
 typedef struct {
   /* Session Discriminators: A unique set of values for these
    * fields identifies a specific session
@@ -62,14 +69,47 @@ typedef struct {
   uint32_t RequiredMinRxInterval;
 } bfdSession;
 
+/* How subscriber callbacks are run (see bfdNotify.c) */
+typedef enum {
+  BFD_NOTIFY_INLINE,     /* from the packet or timer handler */
+  BFD_NOTIFY_DEFERRED,   /* by the event loop, after packets and timers */
+  BFD_NOTIFY_THREAD      /* by a separate callback thread */
+} bfdNotifyMode;
+
+/* Real-time execution settings (see bfdRtSetup) */
+typedef struct {
+  int      Priority;    /* SCHED_FIFO priority, 0 leaves the scheduler alone */
+  int      Cpu;         /* CPU to pin the process to, -1 for no pinning */
+  bool     LockMemory;  /* mlockall() current and future memory */
+  uint32_t Sessions;    /* Number of sessions to preallocate objects for */
+} bfdRtConfig;
+
 /* Function prototypes */
 bfdSubHndl bfdSubscribe(bfdSession *_bfd, bfdSubCB cb, void *arg);
 void bfdUnsubscribe(bfdSubHndl hndl);
 bool bfdCreateSession(bfdSession *_bfd);
 bool bfdDeleteSession(bfdSession *_bfd);
 
+/* Thread-safe versions of the above, run by the event loop thread */
+bool bfdCmdInit(void);
+bool bfdCmdCreateSession(bfdSession *bfd, bfdCmdCB cb, void *arg);
+bool bfdCmdDeleteSession(bfdSession *bfd, bfdCmdCB cb, void *arg);
+bool bfdCmdSubscribe(bfdSession *bfd, bfdSubCB subCb, void *subArg,
+                     bfdSubHndl *hndl, bfdCmdCB cb, void *arg);
+bool bfdCmdUnsubscribe(bfdSubHndl hndl, bfdCmdCB cb, void *arg);
+
 void bfdToggleAdminDown(int sig);
 void bfdStartPollSequence(int sig);
+void bfdLogCounters(int sig);
+
+bool bfdSetNotifyMode(bfdNotifyMode mode);
+
+bool bfdRtSetup(bfdRtConfig *cfg);
+void bfdRtStartupDone(void);
+
+bool bfdPacketAddInterface(const char *ifname);
+bool bfdXdpAddInterface(const char *ifname);
+void bfdXdpEnableFastPath(void);
 
 const char *bfdStateToStr(bfdState state);
 int bfdStateFromStr(bfdState *state, const char *str);
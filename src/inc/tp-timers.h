@@ -7,10 +7,15 @@
 #include <stdint.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct _tpLoop;
 
 typedef struct _tpTimer {
-  struct _tpTimer *next;
-  struct _tpTimer *prev;
+  struct _tpLoop *loop;         /* loop the timer runs in */
+  uint32_t heapIdx;             /* position in the timer heap while running */
   struct timeval expiresAt;
   int running;
   void (*action)(struct _tpTimer *, void *);
@@ -22,15 +27,56 @@ typedef void (*tpTimerAction)(tpTimer *, void *);
 /* Socket listener stuff */
 typedef void (*tpSktActor)(int, void *);
 
-#define TP_MAXSKTS          20
+#define TP_MAXSKTS          FD_SETSIZE
+
+/* Datagram listener stuff: the event engine receives each datagram and passes
+ * it to the actor.  'len' is <0 (errno set) if the receive failed. */
+typedef void (*tpDgramActor)(int, struct msghdr *, ssize_t, void *);
+
+#define TP_MAXDGRAM         512   /* Largest datagram passed to an actor */
+#define TP_MAXDGRAMCTL      128   /* Room for ancillary data */
+
+/* Event engines */
+typedef enum {
+  TP_ENGINE_SELECT,
+  TP_ENGINE_URING
+} tpEngineType;
+
+/* Event engine and timer counters */
+typedef struct {
+  uint64_t timerAllocs;         /* timer heap (re)allocations */
+  uint64_t syscalls;            /* system calls made to wait, receive and send */
+  uint64_t rxDgrams;            /* datagrams passed to datagram actors */
+  uint64_t txDgrams;            /* datagrams sent with tpSendTo() */
+  uint64_t txErrors;            /* datagrams that could not be sent */
+} tpStats;
+
+/* Actors run before each wait for events */
+typedef void (*tpFlushActor)(void *);
+#define TP_MAXFLUSHACTORS   4
+
+/* Initial number of timer heap slots */
+#define TP_MINTIMERS        64
 
 /* Signal handler stuff */
 typedef void (*tpSigActor)(int);
-#define TP_MAXSIGNALS       (SIGUNUSED + 1)
+#define TP_MAXSIGNALS       NSIG
+
+/* Event loop instance.  The functions that don't take a loop work on the
+ * calling thread's current loop, which is a default loop unless set with
+ * tpLoopSetCurrent(). */
+typedef struct _tpLoop tpLoop;
 
 /* Public function prototypes */
 int tpSetSktActor(int skt, tpSktActor actor, void *arg, tpSktActor *old);
+int tpSetDgramActor(int skt, tpDgramActor actor, void *arg);
 int tpRmSktActor(int skt);
+int tpCloseSkt(int skt);
+int tpSendTo(int skt, const void *buf, size_t len,
+             const struct sockaddr *to, socklen_t tolen);
+int tpSetEngine(tpEngineType type);
+const char *tpGetEngineName(void);
+void tpGetStats(tpStats *stats);
 void tpStartMsTimer(tpTimer *t, uint32_t timeout, tpTimerAction action, void *arg);
 void tpStartUsTimer(tpTimer *t, uint32_t timeout, tpTimerAction action, void *arg);
 void tpStartSecTimer(tpTimer *t, uint32_t timeout, tpTimerAction action, void *arg);
@@ -41,17 +87,40 @@ void tpStopEventLoop(void);
 void tpInitTimers(void);
 int64_t tpGetTimeRemaining(tpTimer *t);
 int tpSetSignalActor(tpSigActor actor, int sig);
+int tpSetFlushActor(tpFlushActor actor, void *arg);
+int tpReserveTimers(uint32_t count);
+tpLoop *tpLoopCreate(tpEngineType type);
+void tpLoopDestroy(tpLoop *loop);
+tpLoop *tpLoopSetCurrent(tpLoop *loop);
+tpLoop *tpLoopGetCurrent(void);
+int tpLoopGetFd(tpLoop *loop);
+int tpLoopNextDeadline(tpLoop *loop, struct timeval *deadline);
+int tpLoopRunOnce(tpLoop *loop, const struct timeval *now);
 
 #ifdef TP_PRIVATE
 
 /* Private function prototypes */
 static int tpCompareTime(tpTimer *t1, tpTimer *t2);
-static void tpInsertTimer(tpTimer *t);
+static int tpGrowTimers(tpLoop *loop, uint32_t capacity);
+static void tpHeapSet(tpLoop *loop, uint32_t idx, tpTimer *t);
+static void tpHeapUp(tpLoop *loop, uint32_t idx);
+static void tpHeapDown(tpLoop *loop, uint32_t idx);
+static void tpInsertTimer(tpLoop *loop, tpTimer *t);
 static void tpRemoveTimer(tpTimer *t);
 static void tpSubtractTime(tpTimer *t1, tpTimer *t2, struct timeval *result);
-static struct timeval *tpCheckTimers(void);
-static int tpTimerCompare(const void *a, const void *b, void *p);
-static void tpSigHandler(int sig);
+static struct timeval *tpCheckTimers(tpLoop *loop, const struct timeval *now,
+                                     struct timeval *next);
+static void tpRunFlushActors(tpLoop *loop);
+static void tpReadSignals(int skt, void *arg);
+static void tpLoopInit(tpLoop *loop);
+static int tpLoopSetEngine(tpLoop *loop, tpEngineType type);
+static int tpSelectAddSkt(tpLoop *loop, int skt, int dgram);
+static void tpSelectRmSkt(tpLoop *loop, int skt);
+static int tpSelectSendTo(tpLoop *loop, int skt, const void *buf, size_t len,
+                          const struct sockaddr *to, socklen_t tolen);
+static int tpSelectWait(tpLoop *loop, struct timeval *timeout);
+static int tpSelectGetFd(tpLoop *loop);
+static void tpSelectFini(tpLoop *loop);
 
 #endif  /* TP_PRIVATE */
 